@@ -0,0 +1,928 @@
+#include "lib/fast_png.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <zlib.h>
+
+// SSE2 is part of x86-64, and NEON of AArch64, so neither needs a runtime
+// check.
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FAST_PNG_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define FAST_PNG_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace fast_png {
+
+namespace {
+
+constexpr int kMinMatch = 4;
+constexpr int kMaxMatch = 258;
+constexpr int kWindowSize = 32768;
+constexpr int kHashBits = 15;
+// Tokens per Huffman block; a flat page region takes one per 258 bytes.
+constexpr size_t kBlockTokens = 1 << 14;
+// Filtered bytes gathered before an LZ77 pass over them.
+constexpr size_t kParseChunk = 1 << 16;
+// Hash table entry that is out of reach from any position.
+constexpr int32_t kNoPosition = -kWindowSize - 1;
+
+constexpr int kLiteralLengthCodes = 286;
+constexpr int kDistanceCodes = 30;
+constexpr int kCodeLengthCodes = 19;
+constexpr int kEndOfBlock = 256;
+
+const uint16_t kLengthBase[29] = {3,  4,  5,  6,   7,   8,   9,   10,  11, 13,
+                                  15, 17, 19, 23,  27,  31,  35,  43,  51, 59,
+                                  67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t kLengthExtraBits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                      1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                      4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t kDistanceBase[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const uint8_t kDistanceExtraBits[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                        4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                        9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+// The order code length code lengths are stored in.
+const uint8_t kCodeLengthOrder[kCodeLengthCodes] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+// Length and distance codes by value, the distances as zlib looks them up.
+struct CodeTables {
+  CodeTables() {
+    for (int code = 0; code < 29; ++code) {
+      for (int length = kLengthBase[code];
+           length < kLengthBase[code] + (1 << kLengthExtraBits[code]) &&
+           length <= kMaxMatch;
+           ++length) {
+        length_code[length] = static_cast<uint8_t>(code);
+      }
+    }
+    for (int code = 0; code < 30; ++code) {
+      int first = kDistanceBase[code] - 1;
+      int end = first + (1 << kDistanceExtraBits[code]);
+      if (code < 16) {
+        for (int distance = first; distance < end; ++distance)
+          distance_code[distance] = static_cast<uint8_t>(code);
+      } else {
+        for (int distance = first; distance < end; distance += 128)
+          distance_code[256 + (distance >> 7)] = static_cast<uint8_t>(code);
+      }
+    }
+  }
+
+  int DistanceCode(int distance) const {
+    --distance;
+    return distance < 256 ? distance_code[distance]
+                          : distance_code[256 + (distance >> 7)];
+  }
+
+  uint8_t length_code[kMaxMatch + 1] = {};
+  uint8_t distance_code[512] = {};
+};
+
+const CodeTables& Tables() {
+  static const CodeTables tables;
+  return tables;
+}
+
+inline uint32_t Load32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline uint64_t Load64(const uint8_t* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline void Store64LittleEndian(uint8_t* p, uint64_t value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  for (int i = 0; i < 8; ++i)
+    p[i] = static_cast<uint8_t>(value >> (8 * i));
+#else
+  memcpy(p, &value, sizeof(value));
+#endif
+}
+
+// Filters
+//
+// Each filter writes the first |bpp| bytes, whose left neighbors are zero,
+// and any tail a vector does not fill with scalar code.
+
+uint8_t PaethPredictor(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return static_cast<uint8_t>(a);
+  return static_cast<uint8_t>(pb <= pc ? b : c);
+}
+
+void FilterScalar(int type,
+                  const uint8_t* row,
+                  const uint8_t* prev,
+                  int begin,
+                  int end,
+                  int bpp,
+                  uint8_t* out) {
+  for (int i = begin; i < end; ++i) {
+    int a = i >= bpp ? row[i - bpp] : 0;
+    int b = prev[i];
+    int c = i >= bpp ? prev[i - bpp] : 0;
+    int predictor = 0;
+    switch (type) {
+      case 1:
+        predictor = a;
+        break;
+      case 2:
+        predictor = b;
+        break;
+      case 3:
+        predictor = (a + b) >> 1;
+        break;
+      case 4:
+        predictor = PaethPredictor(a, b, c);
+        break;
+    }
+    out[i] = static_cast<uint8_t>(row[i] - predictor);
+  }
+}
+
+#if defined(FAST_PNG_SSE2)
+
+inline __m128i Load128(const uint8_t* p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+inline __m128i Select(__m128i mask, __m128i yes, __m128i no) {
+  return _mm_or_si128(_mm_and_si128(mask, yes), _mm_andnot_si128(mask, no));
+}
+
+// a <= b for unsigned bytes.
+inline __m128i LessEqual(__m128i a, __m128i b) {
+  return _mm_cmpeq_epi8(_mm_min_epu8(a, b), a);
+}
+
+inline __m128i AbsDiff(__m128i a, __m128i b) {
+  return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+}
+
+// |a + b - 2c| of the bytes, saturated to 255, which keeps the comparisons
+// with the other two distances right.
+inline __m128i PaethDistanceC(__m128i a, __m128i b, __m128i c) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i halves[2];
+  for (int half = 0; half < 2; ++half) {
+    __m128i a16 = half ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+    __m128i b16 = half ? _mm_unpackhi_epi8(b, zero) : _mm_unpacklo_epi8(b, zero);
+    __m128i c16 = half ? _mm_unpackhi_epi8(c, zero) : _mm_unpacklo_epi8(c, zero);
+    __m128i sum = _mm_sub_epi16(_mm_add_epi16(a16, b16), _mm_add_epi16(c16, c16));
+    halves[half] = _mm_max_epi16(sum, _mm_sub_epi16(zero, sum));
+  }
+  return _mm_packus_epi16(halves[0], halves[1]);
+}
+
+int FilterVector(int type,
+                 const uint8_t* row,
+                 const uint8_t* prev,
+                 int bytes,
+                 int bpp,
+                 uint8_t* out) {
+  int i = bpp;
+  for (; i + 16 <= bytes; i += 16) {
+    __m128i x = Load128(row + i);
+    __m128i a = Load128(row + i - bpp);
+    __m128i b = Load128(prev + i);
+    __m128i predictor;
+    switch (type) {
+      case 1:
+        predictor = a;
+        break;
+      case 2:
+        predictor = b;
+        break;
+      case 3:
+        // _mm_avg_epu8() rounds up.
+        predictor = _mm_sub_epi8(
+            _mm_avg_epu8(a, b),
+            _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+        break;
+      default: {
+        __m128i c = Load128(prev + i - bpp);
+        __m128i pa = AbsDiff(b, c);
+        __m128i pb = AbsDiff(a, c);
+        __m128i pc = PaethDistanceC(a, b, c);
+        __m128i use_a = _mm_and_si128(LessEqual(pa, pb), LessEqual(pa, pc));
+        predictor = Select(use_a, a, Select(LessEqual(pb, pc), b, c));
+        break;
+      }
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm_sub_epi8(x, predictor));
+  }
+  return i;
+}
+
+// The sum of the filtered bytes taken as signed values, the cost estimate
+// libpng picks filters by.
+uint64_t Cost(const uint8_t* data, int bytes) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sums = zero;
+  int i = 0;
+  for (; i + 16 <= bytes; i += 16) {
+    __m128i value = Load128(data + i);
+    __m128i magnitude = _mm_min_epu8(value, _mm_sub_epi8(zero, value));
+    sums = _mm_add_epi64(sums, _mm_sad_epu8(magnitude, zero));
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), sums);
+  uint64_t sum = lanes[0] + lanes[1];
+  for (; i < bytes; ++i)
+    sum += data[i] < 128 ? data[i] : 256 - data[i];
+  return sum;
+}
+
+#elif defined(FAST_PNG_NEON)
+
+int FilterVector(int type,
+                 const uint8_t* row,
+                 const uint8_t* prev,
+                 int bytes,
+                 int bpp,
+                 uint8_t* out) {
+  int i = bpp;
+  for (; i + 16 <= bytes; i += 16) {
+    uint8x16_t x = vld1q_u8(row + i);
+    uint8x16_t a = vld1q_u8(row + i - bpp);
+    uint8x16_t b = vld1q_u8(prev + i);
+    uint8x16_t predictor;
+    switch (type) {
+      case 1:
+        predictor = a;
+        break;
+      case 2:
+        predictor = b;
+        break;
+      case 3:
+        predictor = vhaddq_u8(a, b);
+        break;
+      default: {
+        uint8x16_t c = vld1q_u8(prev + i - bpp);
+        uint8x16_t pa = vabdq_u8(b, c);
+        uint8x16_t pb = vabdq_u8(a, c);
+        // |a + b - 2c|, saturated to 255.
+        int16x8_t low = vaddq_s16(
+            vreinterpretq_s16_u16(vsubl_u8(vget_low_u8(a), vget_low_u8(c))),
+            vreinterpretq_s16_u16(vsubl_u8(vget_low_u8(b), vget_low_u8(c))));
+        int16x8_t high = vaddq_s16(
+            vreinterpretq_s16_u16(vsubl_u8(vget_high_u8(a), vget_high_u8(c))),
+            vreinterpretq_s16_u16(vsubl_u8(vget_high_u8(b), vget_high_u8(c))));
+        uint8x16_t pc =
+            vcombine_u8(vqmovn_u16(vreinterpretq_u16_s16(vabsq_s16(low))),
+                        vqmovn_u16(vreinterpretq_u16_s16(vabsq_s16(high))));
+        uint8x16_t use_a = vandq_u8(vcleq_u8(pa, pb), vcleq_u8(pa, pc));
+        predictor = vbslq_u8(use_a, a, vbslq_u8(vcleq_u8(pb, pc), b, c));
+        break;
+      }
+    }
+    vst1q_u8(out + i, vsubq_u8(x, predictor));
+  }
+  return i;
+}
+
+uint64_t Cost(const uint8_t* data, int bytes) {
+  uint64x2_t sums = vdupq_n_u64(0);
+  int i = 0;
+  for (; i + 16 <= bytes; i += 16) {
+    uint8x16_t value = vld1q_u8(data + i);
+    uint8x16_t magnitude = vminq_u8(
+        value, vreinterpretq_u8_s8(vnegq_s8(vreinterpretq_s8_u8(value))));
+    sums = vpadalq_u32(sums, vpaddlq_u16(vpaddlq_u8(magnitude)));
+  }
+  uint64_t sum = vgetq_lane_u64(sums, 0) + vgetq_lane_u64(sums, 1);
+  for (; i < bytes; ++i)
+    sum += data[i] < 128 ? data[i] : 256 - data[i];
+  return sum;
+}
+
+#else
+
+int FilterVector(int type,
+                 const uint8_t* row,
+                 const uint8_t* prev,
+                 int bytes,
+                 int bpp,
+                 uint8_t* out) {
+  return bpp;
+}
+
+uint64_t Cost(const uint8_t* data, int bytes) {
+  uint64_t sum = 0;
+  for (int i = 0; i < bytes; ++i)
+    sum += data[i] < 128 ? data[i] : 256 - data[i];
+  return sum;
+}
+
+#endif
+
+// Writes |row| filtered with PNG filter |type| to |out|. |prev| is the
+// unfiltered row above, all zeros for the first row.
+void FilterRow(int type,
+               const uint8_t* row,
+               const uint8_t* prev,
+               int bytes,
+               int bpp,
+               uint8_t* out) {
+  if (type == 0) {
+    memcpy(out, row, bytes);
+    return;
+  }
+  int head = std::min(bpp, bytes);
+  FilterScalar(type, row, prev, 0, head, bpp, out);
+  int done = head < bytes ? FilterVector(type, row, prev, bytes, bpp, out)
+                          : bytes;
+  FilterScalar(type, row, prev, done, bytes, bpp, out);
+}
+
+// Writes the filtered row to |out| and returns its filter type. With no
+// |filters| given, rows stay unfiltered unless the Up filter cuts their cost
+// eightfold: glyphs and flat areas repeat as they are, which the LZ77 pass
+// finds across rows, while filters pay off on images.
+uint8_t FilterRowBest(const uint8_t* row,
+                      const uint8_t* prev,
+                      int bytes,
+                      int bpp,
+                      int filters,
+                      uint8_t* out,
+                      std::vector<uint8_t>* scratch) {
+  for (int type = 0; type <= 4; ++type) {
+    if (filters == 1 << type) {
+      FilterRow(type, row, prev, bytes, bpp, out);
+      return static_cast<uint8_t>(type);
+    }
+  }
+
+  const bool automatic = !filters;
+  if (automatic)
+    filters = (1 << 0) | (1 << 2);
+  scratch->resize(bytes);
+  // |out| holds the best row so far unless that is the unfiltered one.
+  int best_type = -1;
+  uint64_t best_cost = UINT64_MAX;
+  for (int type = 0; type <= 4 && best_cost; ++type) {
+    if (!(filters & (1 << type)))
+      continue;
+    uint8_t* target = best_type > 0 ? scratch->data() : out;
+    uint64_t cost;
+    if (type == 0) {
+      cost = Cost(row, bytes);
+      if (automatic)
+        cost >>= 3;
+    } else {
+      FilterRow(type, row, prev, bytes, bpp, target);
+      cost = Cost(target, bytes);
+    }
+    if (cost < best_cost) {
+      if (type && target != out)
+        memcpy(out, target, bytes);
+      best_type = type;
+      best_cost = cost;
+    }
+  }
+  if (best_type == 0)
+    memcpy(out, row, bytes);
+  return static_cast<uint8_t>(best_type);
+}
+
+// Huffman codes
+
+// Turns the |count| frequencies of |a|, sorted ascending, into Huffman code
+// lengths in place. Moffat and Katajainen, "In-Place Calculation of
+// Minimum-Redundancy Codes".
+void MinimumRedundancyLengths(int* a, int count) {
+  if (count == 0)
+    return;
+  if (count == 1) {
+    a[0] = 1;
+    return;
+  }
+  a[0] += a[1];
+  int root = 0;
+  int leaf = 2;
+  for (int next = 1; next < count - 1; ++next) {
+    if (leaf >= count || a[root] < a[leaf]) {
+      a[next] = a[root];
+      a[root++] = next;
+    } else {
+      a[next] = a[leaf++];
+    }
+    if (leaf >= count || (root < next && a[root] < a[leaf])) {
+      a[next] += a[root];
+      a[root++] = next;
+    } else {
+      a[next] += a[leaf++];
+    }
+  }
+  a[count - 2] = 0;
+  for (int next = count - 3; next >= 0; --next)
+    a[next] = a[a[next]] + 1;
+  int available = 1;
+  int used = 0;
+  int depth = 0;
+  root = count - 2;
+  int next = count - 1;
+  while (available > 0) {
+    while (root >= 0 && a[root] == depth) {
+      ++used;
+      --root;
+    }
+    while (available > used) {
+      a[next--] = depth;
+      --available;
+    }
+    available = 2 * used;
+    ++depth;
+    used = 0;
+  }
+}
+
+// Sets |lengths| to the code lengths of a Huffman code of at most
+// |max_length| bits for the |count| symbols of |frequencies|. Unused symbols
+// get no code.
+void BuildCodeLengths(const uint32_t* frequencies,
+                      int count,
+                      int max_length,
+                      uint8_t* lengths) {
+  struct Symbol {
+    uint32_t frequency;
+    int symbol;
+  };
+  Symbol symbols[kLiteralLengthCodes];
+  int used = 0;
+  for (int i = 0; i < count; ++i) {
+    lengths[i] = 0;
+    if (frequencies[i])
+      symbols[used++] = {frequencies[i], i};
+  }
+  std::sort(symbols, symbols + used, [](const Symbol& a, const Symbol& b) {
+    return a.frequency < b.frequency ||
+           (a.frequency == b.frequency && a.symbol < b.symbol);
+  });
+
+  int code_lengths[kLiteralLengthCodes];
+  for (int i = 0; i < used; ++i)
+    code_lengths[i] = static_cast<int>(symbols[i].frequency);
+  MinimumRedundancyLengths(code_lengths, used);
+
+  // Cut the codes longer than |max_length| to it, then lengthen shorter
+  // codes until the code is no longer oversubscribed.
+  int length_counts[kLiteralLengthCodes + 1] = {};
+  for (int i = 0; i < used; ++i)
+    ++length_counts[std::min(code_lengths[i], max_length)];
+  uint32_t total = 0;
+  for (int length = 1; length <= max_length; ++length)
+    total += static_cast<uint32_t>(length_counts[length])
+             << (max_length - length);
+  while (total > 1u << max_length) {
+    --length_counts[max_length];
+    for (int length = max_length - 1; length > 0; --length) {
+      if (length_counts[length]) {
+        --length_counts[length];
+        length_counts[length + 1] += 2;
+        break;
+      }
+    }
+    --total;
+  }
+
+  // The most frequent symbols get the shortest codes.
+  int index = used - 1;
+  for (int length = 1; length <= max_length; ++length) {
+    for (int i = 0; i < length_counts[length]; ++i)
+      lengths[symbols[index--].symbol] = static_cast<uint8_t>(length);
+  }
+}
+
+// Sets |codes| to the canonical codes of |lengths|, bit reversed as deflate
+// sends them.
+void BuildCodes(const uint8_t* lengths, int count, uint16_t* codes) {
+  int length_counts[16] = {};
+  for (int i = 0; i < count; ++i)
+    ++length_counts[lengths[i]];
+  length_counts[0] = 0;
+  int next_code[16] = {};
+  int code = 0;
+  for (int length = 1; length < 16; ++length) {
+    code = (code + length_counts[length - 1]) << 1;
+    next_code[length] = code;
+  }
+  for (int i = 0; i < count; ++i) {
+    int length = lengths[i];
+    if (!length)
+      continue;
+    int value = next_code[length]++;
+    int reversed = 0;
+    for (int bit = 0; bit < length; ++bit)
+      reversed |= ((value >> bit) & 1) << (length - 1 - bit);
+    codes[i] = static_cast<uint16_t>(reversed);
+  }
+}
+
+// Makes sure that at least two symbols have codes, as inflaters only take
+// an incomplete code of a single symbol.
+void UseTwoSymbols(uint32_t* frequencies, int count) {
+  int used = 0;
+  for (int i = 0; i < count; ++i)
+    used += frequencies[i] != 0;
+  for (int i = 0; used < 2; ++i) {
+    if (!frequencies[i]) {
+      frequencies[i] = 1;
+      ++used;
+    }
+  }
+}
+
+// Deflate output
+
+class BitWriter {
+ public:
+  explicit BitWriter(std::vector<uint8_t>* out)
+      : out_(out), position_(out->size()) {}
+
+  // Makes room for |bytes| more bytes of output.
+  void Reserve(size_t bytes) {
+    if (out_->size() < position_ + bytes + 8)
+      out_->resize(std::max(out_->size() * 2, position_ + bytes + 8));
+  }
+
+  // Appends the low |count| bits of |value|, |count| at most 56. Stores
+  // all eight bytes of the bit buffer every time, and moves on by the whole
+  // ones, which saves a branch per code.
+  void Put(uint64_t value, int count) {
+    bits_ |= value << count_;
+    count_ += count;
+    Store64LittleEndian(out_->data() + position_, bits_);
+    const int bytes = count_ >> 3;
+    position_ += bytes;
+    bits_ = bytes ? bits_ >> (8 * bytes) : bits_;
+    count_ &= 7;
+  }
+
+  // Pads the output to a whole byte and leaves it in |out|.
+  void Flush() {
+    Reserve(8);
+    while (count_ > 0) {
+      (*out_)[position_++] = static_cast<uint8_t>(bits_);
+      bits_ >>= 8;
+      count_ -= 8;
+    }
+    bits_ = 0;
+    count_ = 0;
+    out_->resize(position_);
+  }
+
+ private:
+  std::vector<uint8_t>* const out_;
+  size_t position_;
+  uint64_t bits_ = 0;
+  int count_ = 0;
+};
+
+// Collects literals and matches, and writes them as dynamic Huffman blocks.
+class BlockWriter {
+ public:
+  explicit BlockWriter(std::vector<uint8_t>* out)
+      : tables_(Tables()), bits_(out) {
+    tokens_.reserve(kBlockTokens + 1);
+  }
+
+  size_t pending() const { return tokens_.size(); }
+
+  void AddLiteral(uint8_t value) {
+    tokens_.push_back(value);
+    ++literal_length_frequencies_[value];
+  }
+
+  void AddMatch(int length, int distance) {
+    tokens_.push_back(static_cast<uint32_t>(length) << 16 |
+                      static_cast<uint32_t>(distance));
+    ++literal_length_frequencies_[257 + tables_.length_code[length]];
+    ++distance_frequencies_[tables_.DistanceCode(distance)];
+  }
+
+  // Writes the pending tokens as one block.
+  void WriteBlock(bool final);
+
+  // Ends the data on a byte boundary: after the final block, or with an
+  // empty stored block.
+  void Finish(bool final) {
+    if (!final) {
+      bits_.Put(0, 3);
+      bits_.Flush();
+      bits_.Reserve(4);
+      bits_.Put(0xFFFF0000u, 32);
+    }
+    bits_.Flush();
+  }
+
+ private:
+  const CodeTables& tables_;
+  BitWriter bits_;
+  std::vector<uint32_t> tokens_;
+  uint32_t literal_length_frequencies_[kLiteralLengthCodes] = {};
+  uint32_t distance_frequencies_[kDistanceCodes] = {};
+};
+
+void BlockWriter::WriteBlock(bool final) {
+  literal_length_frequencies_[kEndOfBlock] = 1;
+  UseTwoSymbols(literal_length_frequencies_, kLiteralLengthCodes);
+  UseTwoSymbols(distance_frequencies_, kDistanceCodes);
+
+  uint8_t lengths[kLiteralLengthCodes + kDistanceCodes];
+  uint8_t* literal_length_lengths = lengths;
+  uint8_t distance_lengths[kDistanceCodes];
+  uint16_t literal_length_codes[kLiteralLengthCodes];
+  uint16_t distance_codes[kDistanceCodes];
+  BuildCodeLengths(literal_length_frequencies_, kLiteralLengthCodes, 15,
+                   literal_length_lengths);
+  BuildCodeLengths(distance_frequencies_, kDistanceCodes, 15,
+                   distance_lengths);
+  BuildCodes(literal_length_lengths, kLiteralLengthCodes, literal_length_codes);
+  BuildCodes(distance_lengths, kDistanceCodes, distance_codes);
+
+  int literal_length_count = kLiteralLengthCodes;
+  while (literal_length_count > 257 &&
+         !literal_length_lengths[literal_length_count - 1]) {
+    --literal_length_count;
+  }
+  int distance_count = kDistanceCodes;
+  while (distance_count > 1 && !distance_lengths[distance_count - 1])
+    --distance_count;
+
+  // The code lengths of both codes form one sequence, run length coded with
+  // code length codes 16 to 18.
+  memcpy(lengths + literal_length_count, distance_lengths, distance_count);
+  const int lengths_count = literal_length_count + distance_count;
+  uint8_t symbols[kLiteralLengthCodes + kDistanceCodes];
+  uint8_t extras[kLiteralLengthCodes + kDistanceCodes];
+  int symbols_count = 0;
+  uint32_t code_length_frequencies[kCodeLengthCodes] = {};
+  auto add_symbol = [&](int symbol, int extra) {
+    symbols[symbols_count] = static_cast<uint8_t>(symbol);
+    extras[symbols_count++] = static_cast<uint8_t>(extra);
+    ++code_length_frequencies[symbol];
+  };
+  for (int i = 0; i < lengths_count;) {
+    int length = lengths[i];
+    int run = 1;
+    while (i + run < lengths_count && lengths[i + run] == length)
+      ++run;
+    i += run;
+    if (length == 0) {
+      for (; run >= 11; run -= std::min(run, 138))
+        add_symbol(18, std::min(run, 138) - 11);
+      if (run >= 3) {
+        add_symbol(17, run - 3);
+        run = 0;
+      }
+    } else {
+      add_symbol(length, 0);
+      for (--run; run >= 3; run -= std::min(run, 6))
+        add_symbol(16, std::min(run, 6) - 3);
+    }
+    for (; run > 0; --run)
+      add_symbol(length, 0);
+  }
+
+  UseTwoSymbols(code_length_frequencies, kCodeLengthCodes);
+  uint8_t code_length_lengths[kCodeLengthCodes];
+  uint16_t code_length_codes[kCodeLengthCodes];
+  BuildCodeLengths(code_length_frequencies, kCodeLengthCodes, 7,
+                   code_length_lengths);
+  BuildCodes(code_length_lengths, kCodeLengthCodes, code_length_codes);
+  int code_length_count = kCodeLengthCodes;
+  while (code_length_count > 4 &&
+         !code_length_lengths[kCodeLengthOrder[code_length_count - 1]]) {
+    --code_length_count;
+  }
+
+  // A match takes at most 48 bits, and Put() writes 8 bytes ahead.
+  bits_.Reserve(16 + (symbols_count * 14 + code_length_count * 3) / 8 +
+                tokens_.size() * 6);
+  bits_.Put(final ? 1 : 0, 1);
+  bits_.Put(2, 2);
+  bits_.Put(literal_length_count - 257, 5);
+  bits_.Put(distance_count - 1, 5);
+  bits_.Put(code_length_count - 4, 4);
+  for (int i = 0; i < code_length_count; ++i)
+    bits_.Put(code_length_lengths[kCodeLengthOrder[i]], 3);
+  static const uint8_t kExtraBits[3] = {2, 3, 7};
+  for (int i = 0; i < symbols_count; ++i) {
+    int symbol = symbols[i];
+    bits_.Put(code_length_codes[symbol], code_length_lengths[symbol]);
+    if (symbol >= 16)
+      bits_.Put(extras[i], kExtraBits[symbol - 16]);
+  }
+
+  for (uint32_t token : tokens_) {
+    if (token < 256) {
+      bits_.Put(literal_length_codes[token], literal_length_lengths[token]);
+      continue;
+    }
+    int length = token >> 16;
+    int distance = token & 0xFFFF;
+    int length_code = tables_.length_code[length];
+    int symbol = 257 + length_code;
+    int distance_code = tables_.DistanceCode(distance);
+    uint64_t bits = literal_length_codes[symbol];
+    int count = literal_length_lengths[symbol];
+    bits |= static_cast<uint64_t>(length - kLengthBase[length_code]) << count;
+    count += kLengthExtraBits[length_code];
+    bits |= static_cast<uint64_t>(distance_codes[distance_code]) << count;
+    count += distance_lengths[distance_code];
+    bits |= static_cast<uint64_t>(distance - kDistanceBase[distance_code])
+            << count;
+    count += kDistanceExtraBits[distance_code];
+    bits_.Put(bits, count);
+  }
+  bits_.Put(literal_length_codes[kEndOfBlock],
+            literal_length_lengths[kEndOfBlock]);
+
+  tokens_.clear();
+  memset(literal_length_frequencies_, 0, sizeof(literal_length_frequencies_));
+  memset(distance_frequencies_, 0, sizeof(distance_frequencies_));
+}
+
+// LZ77
+
+int MatchLength(const uint8_t* a, const uint8_t* b, int max_length) {
+  int length = 0;
+  while (length + 8 <= max_length && Load64(a + length) == Load64(b + length))
+    length += 8;
+  while (length < max_length && a[length] == b[length])
+    ++length;
+  return length;
+}
+
+inline uint32_t Hash(uint32_t value) {
+  return (value * 0x9E3779B1u) >> (32 - kHashBits);
+}
+
+// Holds the filtered rows from 32K bytes before the first one not parsed
+// yet, and turns them into tokens with a greedy parse. Each position looks
+// up the last one with the same four bytes, and the one a row above.
+class Compressor {
+ public:
+  Compressor(int stride, std::vector<uint8_t>* out)
+      : stride_(stride),
+        window_(std::max<size_t>(4 * kParseChunk, 2 * stride) + kWindowSize +
+                kMaxMatch),
+        hashes_(1 << kHashBits, kNoPosition),
+        blocks_(out) {}
+
+  // Returns where the next |bytes| bytes of data go.
+  uint8_t* Append(size_t bytes) {
+    if (end_ + bytes > window_.size())
+      Slide();
+    return &window_[end_];
+  }
+
+  // Takes in |bytes| bytes written to Append().
+  void Commit(size_t bytes) {
+    end_ += bytes;
+    if (end_ - parsed_ >= kParseChunk + kMaxMatch)
+      Parse(false);
+  }
+
+  void Finish(bool final) {
+    Parse(true);
+    blocks_.WriteBlock(final);
+    blocks_.Finish(final);
+  }
+
+ private:
+  // Parses the data up to |kMaxMatch| bytes before its end, or all of it
+  // with |final|.
+  void Parse(bool final);
+
+  // Drops the data from before the window of the next position to parse.
+  void Slide();
+
+  const size_t stride_;
+  std::vector<uint8_t> window_;
+  size_t parsed_ = 0;
+  size_t end_ = 0;
+  // The last position of each hash of four bytes.
+  std::vector<int32_t> hashes_;
+  BlockWriter blocks_;
+};
+
+void Compressor::Parse(bool final) {
+  const uint8_t* data = window_.data();
+  const size_t end = end_;
+  const size_t limit = final ? end : end - std::min<size_t>(end, kMaxMatch);
+  const bool check_above = stride_ <= static_cast<size_t>(kWindowSize);
+  size_t i = parsed_;
+  while (i < limit) {
+    if (i + kMinMatch > end) {
+      blocks_.AddLiteral(data[i++]);
+      continue;
+    }
+    const uint32_t value = Load32(data + i);
+    int32_t& slot = hashes_[Hash(value)];
+    const int64_t candidate = slot;
+    slot = static_cast<int32_t>(i);
+
+    const int max_length = static_cast<int>(std::min<size_t>(kMaxMatch, end - i));
+    int length = 0;
+    size_t distance = 0;
+    if (static_cast<int64_t>(i) - candidate <= kWindowSize &&
+        Load32(data + candidate) == value) {
+      length = MatchLength(data + candidate, data + i, max_length);
+      distance = i - static_cast<size_t>(candidate);
+    }
+    if (check_above && length < max_length && i >= stride_ &&
+        static_cast<int64_t>(i - stride_) != candidate &&
+        Load32(data + i - stride_) == value) {
+      int above = MatchLength(data + i - stride_, data + i, max_length);
+      if (above > length) {
+        length = above;
+        distance = stride_;
+      }
+    }
+
+    if (length >= kMinMatch) {
+      blocks_.AddMatch(length, static_cast<int>(distance));
+      i += length;
+    } else {
+      blocks_.AddLiteral(data[i++]);
+    }
+    if (blocks_.pending() >= kBlockTokens)
+      blocks_.WriteBlock(false);
+  }
+  parsed_ = i;
+}
+
+void Compressor::Slide() {
+  Parse(false);
+  const size_t keep = std::min(parsed_, static_cast<size_t>(kWindowSize));
+  const size_t shift = parsed_ - keep;
+  memmove(window_.data(), window_.data() + shift, end_ - shift);
+  parsed_ -= shift;
+  end_ -= shift;
+  for (int32_t& position : hashes_) {
+    position = position >= static_cast<int64_t>(shift)
+                   ? position - static_cast<int32_t>(shift)
+                   : kNoPosition;
+  }
+}
+
+}  // namespace
+
+void DeflateRows(const RowSource& source,
+                 int first_row,
+                 int rows,
+                 int row_bytes,
+                 int bpp,
+                 int filters,
+                 bool last,
+                 std::vector<uint8_t>* out,
+                 uint32_t* adler) {
+  std::vector<uint8_t> buffers[2];
+  buffers[0].assign(row_bytes, 0);
+  buffers[1].resize(row_bytes);
+  std::vector<uint8_t> scratch;
+  const size_t stride = static_cast<size_t>(row_bytes) + 1;
+
+  const uint8_t* prev = buffers[0].data();
+  if (first_row > 0)
+    prev = source(first_row - 1, buffers[0].data());
+  Compressor compressor(static_cast<int>(stride), out);
+  uLong checksum = adler32(0, nullptr, 0);
+  for (int y = 0; y < rows; ++y) {
+    const uint8_t* row = source(first_row + y, buffers[(y + 1) % 2].data());
+    uint8_t* filtered = compressor.Append(stride);
+    filtered[0] = FilterRowBest(row, prev, row_bytes, bpp, filters,
+                                filtered + 1, &scratch);
+    checksum = adler32_z(checksum, filtered, stride);
+    compressor.Commit(stride);
+    prev = row;
+  }
+  compressor.Finish(last);
+  *adler = static_cast<uint32_t>(checksum);
+}
+
+}  // namespace fast_png
@@ -14,10 +14,14 @@
 #define USE_SYSTEM_ZLIB
 #define USE_SYSTEM_LIBPNG
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <functional>
 #include <string>
+#include <thread>
 
 // #include "third_party/base/compiler_specific.h"
 // #include "third_party/base/notreached.h"
@@ -34,7 +38,9 @@
 #include "third_party/libpng16/png.h"
 #endif
 
+#include "lib/fast_png.h"
 #include "lib/notreached.h"
+#include "lib/pixel_convert.h"
 
 
 #if defined(__clang__)
@@ -77,40 +83,21 @@ void ConvertBetweenBGRAandRGBA(const uint8_t* input,
                                int pixel_width,
                                uint8_t* output,
                                bool* is_opaque) {
-  for (int x = 0; x < pixel_width; x++) {
-    const uint8_t* pixel_in = &input[x * 4];
-    uint8_t* pixel_out = &output[x * 4];
-    pixel_out[0] = pixel_in[2];
-    pixel_out[1] = pixel_in[1];
-    pixel_out[2] = pixel_in[0];
-    pixel_out[3] = pixel_in[3];
-  }
+  pixel_convert::SwapRedBlue(input, pixel_width, output);
 }
 
 void ConvertBGRtoRGB(const uint8_t* bgr,
                      int pixel_width,
                      uint8_t* rgb,
                      bool* is_opaque) {
-  for (int x = 0; x < pixel_width; x++) {
-    const uint8_t* pixel_in = &bgr[x * 3];
-    uint8_t* pixel_out = &rgb[x * 3];
-    pixel_out[0] = pixel_in[2];
-    pixel_out[1] = pixel_in[1];
-    pixel_out[2] = pixel_in[0];
-  }
+  pixel_convert::BGRToRGB(bgr, pixel_width, rgb);
 }
 
 void ConvertRGBAtoRGB(const uint8_t* rgba,
                       int pixel_width,
                       uint8_t* rgb,
                       bool* is_opaque) {
-  const uint8_t* pixel_in = rgba;
-  uint8_t* pixel_out = rgb;
-  for (int x = 0; x < pixel_width; x++) {
-    memcpy(pixel_out, pixel_in, 3);
-    pixel_in += 4;
-    pixel_out += 3;
-  }
+  pixel_convert::RGBAToRGB(rgba, pixel_width, rgb);
 }
 
 // Decoder
@@ -174,14 +161,7 @@ void ConvertRGBtoBGRA(const uint8_t* rgb,
                       int pixel_width,
                       uint8_t* bgra,
                       bool* is_opaque) {
-  for (int x = 0; x < pixel_width; x++) {
-    const uint8_t* pixel_in = &rgb[x * 3];
-    uint8_t* pixel_out = &bgra[x * 4];
-    pixel_out[0] = pixel_in[2];
-    pixel_out[1] = pixel_in[1];
-    pixel_out[2] = pixel_in[0];
-    pixel_out[3] = 0xff;
-  }
+  pixel_convert::RGBToBGRA(rgb, pixel_width, bgra);
 }
 
 // Called when the png header has been read. This code is based on the WebKit
@@ -428,13 +408,7 @@ void ConvertBGRAtoRGB(const uint8_t* bgra,
                       int pixel_width,
                       uint8_t* rgb,
                       bool* is_opaque) {
-  for (int x = 0; x < pixel_width; x++) {
-    const uint8_t* pixel_in = &bgra[x * 4];
-    uint8_t* pixel_out = &rgb[x * 3];
-    pixel_out[0] = pixel_in[2];
-    pixel_out[1] = pixel_in[1];
-    pixel_out[2] = pixel_in[0];
-  }
+  pixel_convert::BGRAToRGB(bgra, pixel_width, rgb);
 }
 
 #ifdef PNG_TEXT_SUPPORTED
@@ -496,6 +470,38 @@ typedef void (*FormatConverter)(const uint8_t* in,
                                 uint8_t* out,
                                 bool* is_opaque);
 
+// The PLTE entries of an indexed image, and their tRNS alphas unless all of
+// them are opaque.
+struct PngPalette {
+  std::vector<png_color> colors;
+  std::vector<uint8_t> alphas;
+};
+
+int ZlibStrategy(DeflateStrategy strategy) {
+  switch (strategy) {
+    case DeflateStrategy::kFiltered:
+      return Z_FILTERED;
+    case DeflateStrategy::kRle:
+      return Z_RLE;
+    case DeflateStrategy::kHuffmanOnly:
+      return Z_HUFFMAN_ONLY;
+    default:
+      return Z_DEFAULT_STRATEGY;
+  }
+}
+
+// Applies the compression settings of |options| to a libpng write struct.
+// Settings left to the encoder keep the libpng defaults. Must run under a
+// setjmp().
+void SetLibpngCompression(png_struct* png_ptr, const EncodeOptions& options) {
+  png_set_compression_level(png_ptr, options.compression_level);
+  if (options.strategy != DeflateStrategy::kAuto)
+    png_set_compression_strategy(png_ptr, ZlibStrategy(options.strategy));
+  // The kFilter* bits line up with PNG_FILTER_NONE and the following ones.
+  if (options.filters & kAllFilters)
+    png_set_filter(png_ptr, 0, (options.filters & kAllFilters) << 3);
+}
+
 // libpng uses a wacky setjmp-based API, which makes the compiler nervous.
 // We constrain all of the calls we make to libpng where the setjmp() is in
 // place to this function.
@@ -507,9 +513,11 @@ bool DoLibpngWrite(png_struct* png_ptr,
                    int height,
                    int row_byte_width,
                    pdfium::span<const uint8_t> input,
-                   int compression_level,
+                   const EncodeOptions& options,
                    int png_output_color_type,
+                   int bit_depth,
                    int output_color_components,
+                   const PngPalette* palette,
                    FormatConverter converter,
                    const std::vector<Comment>& comments) {
 #ifdef PNG_TEXT_SUPPORTED
@@ -525,14 +533,23 @@ bool DoLibpngWrite(png_struct* png_ptr,
     return false;
   }
 
-  png_set_compression_level(png_ptr, compression_level);
+  SetLibpngCompression(png_ptr, options);
 
   // Set our callback for libpng to give us the data.
   png_set_write_fn(png_ptr, state, EncoderWriteCallback, FakeFlushCallback);
 
-  png_set_IHDR(png_ptr, info_ptr, width, height, 8, png_output_color_type,
-               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-               PNG_FILTER_TYPE_DEFAULT);
+  png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth,
+               png_output_color_type, PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+  if (palette) {
+    png_set_PLTE(png_ptr, info_ptr, palette->colors.data(),
+                 static_cast<int>(palette->colors.size()));
+    if (!palette->alphas.empty()) {
+      png_set_tRNS(png_ptr, info_ptr, palette->alphas.data(),
+                   static_cast<int>(palette->alphas.size()), nullptr);
+    }
+  }
 
 #ifdef PNG_TEXT_SUPPORTED
   if (comment_writer.HasComments()) {
@@ -562,16 +579,696 @@ bool DoLibpngWrite(png_struct* png_ptr,
   return true;
 }
 
-std::vector<uint8_t> EncodeWithCompressionLevel(
-    pdfium::span<const uint8_t> input,
-    ColorFormat format,
-    const int width,
-    const int height,
-    int row_byte_width,
-    bool discard_transparency,
-    const std::vector<Comment>& comments,
-    int compression_level) {
+// Parallel encoder
+//
+// Works like pigz: the image is cut into horizontal bands that are filtered
+// and deflated on separate threads. Every band but the last ends with a sync
+// flush, so the raw deflate streams concatenate into one zlib stream, whose
+// Adler-32 is combined from the checksums of the bands. Each band is primed
+// with the last 32K of the previous one, which keeps the size close to a
+// single stream.
+
+constexpr int kMinRowsPerParallelBand = 16;
+constexpr size_t kDeflateWindowSize = 32768;
+constexpr size_t kMaxZlibChunk = 1 << 30;
+constexpr size_t kIdatChunkSize = 1 << 20;
+
+// Runs |task(0)| ... |task(count - 1)| on |count| threads, one on this one.
+void RunInParallel(int count, const std::function<void(int)>& task) {
+  std::vector<std::thread> threads;
+  for (int i = 1; i < count; ++i)
+    threads.emplace_back(task, i);
+  task(0);
+  for (std::thread& thread : threads)
+    thread.join();
+}
+
+void AppendUint32(std::vector<uint8_t>* out, uint32_t value) {
+  out->push_back(static_cast<uint8_t>(value >> 24));
+  out->push_back(static_cast<uint8_t>(value >> 16));
+  out->push_back(static_cast<uint8_t>(value >> 8));
+  out->push_back(static_cast<uint8_t>(value));
+}
+
+void AppendChunk(std::vector<uint8_t>* out,
+                 const char* type,
+                 const uint8_t* data,
+                 size_t size) {
+  AppendUint32(out, static_cast<uint32_t>(size));
+  size_t type_pos = out->size();
+  out->insert(out->end(), type, type + 4);
+  out->insert(out->end(), data, data + size);
+  AppendUint32(out, static_cast<uint32_t>(crc32_z(
+                        0, &(*out)[type_pos], out->size() - type_pos)));
+}
+
+void AppendPngHeader(std::vector<uint8_t>* out,
+                     int width,
+                     int height,
+                     int bit_depth,
+                     int color_type) {
+  static const uint8_t kSignature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a,
+                                       '\n'};
+  out->insert(out->end(), kSignature, kSignature + sizeof(kSignature));
+
+  std::vector<uint8_t> ihdr;
+  AppendUint32(&ihdr, width);
+  AppendUint32(&ihdr, height);
+  ihdr.push_back(static_cast<uint8_t>(bit_depth));
+  ihdr.push_back(static_cast<uint8_t>(color_type));
+  ihdr.push_back(0);  // Compression method.
+  ihdr.push_back(0);  // Filter method.
+  ihdr.push_back(0);  // No interlace.
+  AppendChunk(out, "IHDR", ihdr.data(), ihdr.size());
+}
+
+void AppendPalette(std::vector<uint8_t>* out, const PngPalette& palette) {
+  std::vector<uint8_t> plte;
+  for (const png_color& color : palette.colors) {
+    plte.push_back(color.red);
+    plte.push_back(color.green);
+    plte.push_back(color.blue);
+  }
+  AppendChunk(out, "PLTE", plte.data(), plte.size());
+  if (!palette.alphas.empty())
+    AppendChunk(out, "tRNS", palette.alphas.data(), palette.alphas.size());
+}
+
+// Stores |zlib| in IDAT chunks and closes the image.
+void AppendPngData(std::vector<uint8_t>* out,
+                   const std::vector<uint8_t>& zlib) {
+  for (size_t pos = 0; pos < zlib.size(); pos += kIdatChunkSize) {
+    AppendChunk(out, "IDAT", &zlib[pos],
+                std::min(kIdatChunkSize, zlib.size() - pos));
+  }
+  AppendChunk(out, "IEND", nullptr, 0);
+}
+
+// The two byte zlib header for a 32K window, with the level hint zlib writes.
+void AppendZlibHeader(std::vector<uint8_t>* out, int compression_level) {
+  int level_flag = 2;
+  if (compression_level == 0 || compression_level == 1)
+    level_flag = 0;
+  else if (compression_level >= 2 && compression_level <= 5)
+    level_flag = 1;
+  else if (compression_level >= 7)
+    level_flag = 3;
+  const int cmf = 0x78;
+  int flg = level_flag << 6;
+  flg += 31 - ((cmf << 8) + flg) % 31;
+  out->push_back(cmf);
+  out->push_back(static_cast<uint8_t>(flg));
+}
+
+uint8_t PaethPredictor(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return static_cast<uint8_t>(a);
+  return static_cast<uint8_t>(pb <= pc ? b : c);
+}
+
+// Writes row |row| filtered with PNG filter |type| to |out|. |prev| is the
+// unfiltered row above, all zeros for the first row.
+void FilterRow(int type,
+               const uint8_t* row,
+               const uint8_t* prev,
+               int bytes,
+               int bpp,
+               uint8_t* out) {
+  switch (type) {
+    case 0:
+      memcpy(out, row, bytes);
+      break;
+    case 1:
+      for (int i = 0; i < bytes; ++i)
+        out[i] = row[i] - (i >= bpp ? row[i - bpp] : 0);
+      break;
+    case 2:
+      for (int i = 0; i < bytes; ++i)
+        out[i] = row[i] - prev[i];
+      break;
+    case 3:
+      for (int i = 0; i < bytes; ++i)
+        out[i] = row[i] - (((i >= bpp ? row[i - bpp] : 0) + prev[i]) >> 1);
+      break;
+    case 4:
+      for (int i = 0; i < bytes; ++i) {
+        out[i] = row[i] - PaethPredictor(i >= bpp ? row[i - bpp] : 0, prev[i],
+                                         i >= bpp ? prev[i - bpp] : 0);
+      }
+      break;
+  }
+}
+
+// Writes the filter byte and the filtered row to |out|, picking the filter
+// of the |filters| kFilter* bits whose output has the smallest sum of
+// absolute signed values. This is the heuristic libpng uses when several
+// filters are enabled.
+void FilterRowAdaptive(const uint8_t* row,
+                       const uint8_t* prev,
+                       int bytes,
+                       int bpp,
+                       int filters,
+                       uint8_t* out,
+                       std::vector<uint8_t>* scratch) {
+  for (int type = 0; type <= 4; ++type) {
+    // A single filter needs no trial.
+    if (filters == 1 << type) {
+      out[0] = static_cast<uint8_t>(type);
+      FilterRow(type, row, prev, bytes, bpp, out + 1);
+      return;
+    }
+  }
+
+  scratch->resize(bytes);
+  uint64_t best_sum = UINT64_MAX;
+  for (int type = 0; type <= 4; ++type) {
+    if (!(filters & (1 << type)))
+      continue;
+    FilterRow(type, row, prev, bytes, bpp, scratch->data());
+    uint64_t sum = 0;
+    for (int i = 0; i < bytes; ++i) {
+      uint8_t value = (*scratch)[i];
+      sum += value < 128 ? value : 256 - value;
+    }
+    if (sum < best_sum) {
+      best_sum = sum;
+      out[0] = static_cast<uint8_t>(type);
+      memcpy(out + 1, scratch->data(), bytes);
+    }
+    if (best_sum == 0)
+      break;
+  }
+}
+
+// Deflates |in| as a raw deflate stream appended to |out|, ending with a
+// sync flush, or with the final block when |last| is set.
+bool DeflateBand(const std::vector<uint8_t>& in,
+                 const uint8_t* dictionary,
+                 size_t dictionary_size,
+                 int compression_level,
+                 int strategy,
+                 bool last,
+                 std::vector<uint8_t>* out) {
+  z_stream stream = {};
+  if (deflateInit2(&stream, compression_level, Z_DEFLATED, -15, 8,
+                   strategy) != Z_OK) {
+    return false;
+  }
+  if (dictionary_size) {
+    deflateSetDictionary(&stream, dictionary,
+                         static_cast<uInt>(dictionary_size));
+  }
+
+  out->resize(in.size() / 2 + 64);
+  size_t in_pos = 0;
+  size_t out_pos = 0;
+  int result = Z_OK;
+  do {
+    size_t chunk = std::min(in.size() - in_pos, kMaxZlibChunk);
+    stream.next_in = const_cast<uint8_t*>(in.data() + in_pos);
+    stream.avail_in = static_cast<uInt>(chunk);
+    in_pos += chunk;
+    int flush = in_pos < in.size() ? Z_NO_FLUSH
+                                    : (last ? Z_FINISH : Z_SYNC_FLUSH);
+    do {
+      if (out_pos == out->size())
+        out->resize(out->size() * 2);
+      size_t space = std::min(out->size() - out_pos, kMaxZlibChunk);
+      stream.next_out = out->data() + out_pos;
+      stream.avail_out = static_cast<uInt>(space);
+      result = deflate(&stream, flush);
+      out_pos += space - stream.avail_out;
+    } while (stream.avail_out == 0 && result != Z_STREAM_ERROR);
+  } while (in_pos < in.size() && result != Z_STREAM_ERROR);
+  deflateEnd(&stream);
+
+  out->resize(out_pos);
+  return result == (last ? Z_STREAM_END : Z_OK);
+}
+
+std::vector<uint8_t> EncodeParallel(pdfium::span<const uint8_t> input,
+                                    int width,
+                                    int height,
+                                    int row_byte_width,
+                                    int png_output_color_type,
+                                    int bit_depth,
+                                    int output_color_components,
+                                    const PngPalette* palette,
+                                    FormatConverter converter,
+                                    const EncodeOptions& options) {
+  struct Band {
+    int first_row;
+    int rows;
+    std::vector<uint8_t> filtered;
+    std::vector<uint8_t> deflated;
+    uLong adler = 0;
+    bool ok = false;
+  };
+
+  const int bands_count =
+      std::min(options.threads, height / kMinRowsPerParallelBand);
+  const int filters =
+      options.filters & kAllFilters ? options.filters & kAllFilters
+                                    : kAllFilters;
+  const int row_bytes = (width * output_color_components * bit_depth + 7) / 8;
+  std::vector<Band> bands(bands_count);
+  for (int i = 0; i < bands_count; ++i) {
+    bands[i].first_row = static_cast<int>(
+        static_cast<int64_t>(height) * i / bands_count);
+    bands[i].rows = static_cast<int>(static_cast<int64_t>(height) * (i + 1) /
+                                     bands_count) -
+                    bands[i].first_row;
+  }
+
+  RunInParallel(bands_count, [&](int i) {
+    Band& band = bands[i];
+    std::vector<uint8_t> rows[2];
+    rows[0].assign(row_bytes, 0);
+    rows[1].resize(row_bytes);
+    std::vector<uint8_t> scratch;
+    auto get_row = [&](int y, std::vector<uint8_t>* buffer) {
+      const uint8_t* src = &input[static_cast<size_t>(y) * row_byte_width];
+      if (!converter)
+        return src;
+      converter(src, width, buffer->data(), nullptr);
+      return static_cast<const uint8_t*>(buffer->data());
+    };
+
+    const uint8_t* prev = rows[0].data();
+    if (band.first_row > 0)
+      prev = get_row(band.first_row - 1, &rows[0]);
+    band.filtered.resize(static_cast<size_t>(band.rows) * (row_bytes + 1));
+    for (int y = 0; y < band.rows; ++y) {
+      std::vector<uint8_t>* buffer = &rows[(y + 1) % 2];
+      const uint8_t* row = get_row(band.first_row + y, buffer);
+      FilterRowAdaptive(row, prev, row_bytes, output_color_components, filters,
+                        &band.filtered[static_cast<size_t>(y) * (row_bytes + 1)],
+                        &scratch);
+      prev = row;
+    }
+  });
+
+  RunInParallel(bands_count, [&](int i) {
+    Band& band = bands[i];
+    const uint8_t* dictionary = nullptr;
+    size_t dictionary_size = 0;
+    if (i > 0) {
+      const std::vector<uint8_t>& previous = bands[i - 1].filtered;
+      dictionary_size = std::min(previous.size(), kDeflateWindowSize);
+      dictionary = previous.data() + previous.size() - dictionary_size;
+    }
+    band.ok = DeflateBand(band.filtered, dictionary, dictionary_size,
+                          options.compression_level,
+                          ZlibStrategy(options.strategy), i == bands_count - 1,
+                          &band.deflated);
+    band.adler = adler32_z(adler32(0, nullptr, 0), band.filtered.data(),
+                           band.filtered.size());
+  });
+
+  std::vector<uint8_t> zlib;
+  AppendZlibHeader(&zlib, options.compression_level);
+  uLong adler = adler32(0, nullptr, 0);
+  for (Band& band : bands) {
+    if (!band.ok)
+      return std::vector<uint8_t>();
+    zlib.insert(zlib.end(), band.deflated.begin(), band.deflated.end());
+    adler = adler32_combine(adler, band.adler, band.filtered.size());
+    std::vector<uint8_t>().swap(band.deflated);
+  }
+  AppendUint32(&zlib, static_cast<uint32_t>(adler));
+
   std::vector<uint8_t> output;
+  AppendPngHeader(&output, width, height, bit_depth, png_output_color_type);
+  if (palette)
+    AppendPalette(&output, *palette);
+  AppendPngData(&output, zlib);
+  return output;
+}
+
+// Like EncodeParallel(), with fast_png compressing the bands. Each band
+// starts afresh, rather than with the data before it as a dictionary.
+std::vector<uint8_t> EncodeFast(pdfium::span<const uint8_t> input,
+                                int width,
+                                int height,
+                                int row_byte_width,
+                                int png_output_color_type,
+                                int bit_depth,
+                                int output_color_components,
+                                const PngPalette* palette,
+                                FormatConverter converter,
+                                const EncodeOptions& options) {
+  struct Band {
+    int first_row;
+    int rows;
+    std::vector<uint8_t> deflated;
+    uint32_t adler = 0;
+  };
+
+  const int bands_count = std::max(
+      1, std::min(options.threads, height / kMinRowsPerParallelBand));
+  const int row_bytes = (width * output_color_components * bit_depth + 7) / 8;
+  const int bpp = std::max(1, output_color_components * bit_depth / 8);
+  std::vector<Band> bands(bands_count);
+  for (int i = 0; i < bands_count; ++i) {
+    bands[i].first_row = static_cast<int>(
+        static_cast<int64_t>(height) * i / bands_count);
+    bands[i].rows = static_cast<int>(static_cast<int64_t>(height) * (i + 1) /
+                                     bands_count) -
+                    bands[i].first_row;
+  }
+
+  fast_png::RowSource source = [&](int y, uint8_t* buffer) {
+    const uint8_t* src = &input[static_cast<size_t>(y) * row_byte_width];
+    if (!converter)
+      return src;
+    converter(src, width, buffer, nullptr);
+    return static_cast<const uint8_t*>(buffer);
+  };
+  RunInParallel(bands_count, [&](int i) {
+    Band& band = bands[i];
+    fast_png::DeflateRows(source, band.first_row, band.rows, row_bytes, bpp,
+                          options.filters & kAllFilters,
+                          i == bands_count - 1, &band.deflated, &band.adler);
+  });
+
+  std::vector<uint8_t> zlib;
+  AppendZlibHeader(&zlib, /*compression_level=*/1);
+  uLong adler = adler32(0, nullptr, 0);
+  for (Band& band : bands) {
+    zlib.insert(zlib.end(), band.deflated.begin(), band.deflated.end());
+    adler = adler32_combine(adler, band.adler,
+                            static_cast<z_off_t>(band.rows) * (row_bytes + 1));
+    std::vector<uint8_t>().swap(band.deflated);
+  }
+  AppendUint32(&zlib, static_cast<uint32_t>(adler));
+
+  std::vector<uint8_t> output;
+  AppendPngHeader(&output, width, height, bit_depth, png_output_color_type);
+  if (palette)
+    AppendPalette(&output, *palette);
+  AppendPngData(&output, zlib);
+  return output;
+}
+
+// Color reduction
+//
+// Rendered pages are mostly opaque, and often gray or of few colors. Such
+// images are written as gray or indexed PNGs with as few bits per pixel as
+// hold them exactly, which leaves deflate far fewer bytes to go through.
+
+// An image converted to a smaller PNG color type: rows of |row_bytes| bytes,
+// and for PNG_COLOR_TYPE_PALETTE its palette.
+struct ReducedImage {
+  int color_type = PNG_COLOR_TYPE_GRAY;
+  int bit_depth = 8;
+  int channels = 1;
+  int row_bytes = 0;
+  std::vector<uint8_t> pixels;
+  PngPalette palette;
+};
+
+enum class Reduction {
+  // The image needs the color type it would be written in anyway.
+  kNone,
+  // The image has alpha but is opaque, and can be written as RGB.
+  kOpaque,
+  // The image is in the ReducedImage.
+  kReduced,
+};
+
+constexpr size_t kMaxPaletteSize = 256;
+
+// The fewest bits per pixel that index |count| palette entries.
+int PaletteBitDepth(int count) {
+  return count <= 2 ? 1 : count <= 4 ? 2 : count <= 16 ? 4 : 8;
+}
+
+// The fewest bits per pixel of a gray image that hold all the |used| levels
+// exactly; with n bits those are the multiples of 255 / (2^n - 1).
+int GrayBitDepth(const bool used[256]) {
+  for (int bit_depth = 1; bit_depth < 8; bit_depth *= 2) {
+    int step = 255 / ((1 << bit_depth) - 1);
+    bool exact = true;
+    for (int level = 0; level < 256 && exact; ++level)
+      exact = !used[level] || level % step == 0;
+    if (exact)
+      return bit_depth;
+  }
+  return 8;
+}
+
+// Maps the one byte per pixel of |reduced| through |lookup| and packs its
+// rows to |reduced->bit_depth| bits per pixel, in place.
+void PackRows(const uint8_t lookup[256],
+              int width,
+              int height,
+              ReducedImage* reduced) {
+  const int bit_depth = reduced->bit_depth;
+  const int pixels_per_byte = 8 / bit_depth;
+  reduced->row_bytes = (width * bit_depth + 7) / 8;
+  uint8_t* data = reduced->pixels.data();
+  for (int y = 0; y < height; ++y) {
+    // Each output byte lands before the input it was made of.
+    const uint8_t* in = data + static_cast<size_t>(y) * width;
+    uint8_t* out = data + static_cast<size_t>(y) * reduced->row_bytes;
+    for (int x = 0; x < width; x += pixels_per_byte) {
+      unsigned byte = 0;
+      for (int i = 0; i < pixels_per_byte; ++i) {
+        byte <<= bit_depth;
+        if (x + i < width)
+          byte |= lookup[in[x + i]];
+      }
+      out[x / pixels_per_byte] = static_cast<uint8_t>(byte);
+    }
+  }
+  reduced->pixels.resize(static_cast<size_t>(reduced->row_bytes) * height);
+}
+
+// Finds the smallest PNG color type and bit depth that hold the RGB(A) or
+// BGR(A) image in |input| exactly, and converts it to that in |reduced|. The
+// gray check and the gray levels come from the vector scans of
+// pixel_convert; only images with color or transparency are looked at pixel
+// by pixel, for a palette, until they turn out to have too many colors.
+Reduction ReduceColors(pdfium::span<const uint8_t> input,
+                       ColorFormat format,
+                       int width,
+                       int height,
+                       int row_byte_width,
+                       bool discard_transparency,
+                       ReducedImage* reduced) {
+  const int input_color_components =
+      format == FORMAT_RGB || format == FORMAT_BGR ? 3 : 4;
+  const bool has_alpha = input_color_components == 4 && !discard_transparency;
+  if (width <= 0 || height <= 0 ||
+      row_byte_width < input_color_components * width ||
+      input.size() < static_cast<size_t>(height - 1) * row_byte_width +
+                         static_cast<size_t>(input_color_components) * width) {
+    return Reduction::kNone;
+  }
+  auto row = [&](int y) {
+    return &input[static_cast<size_t>(y) * row_byte_width];
+  };
+
+  std::vector<uint8_t>& pixels = reduced->pixels;
+  pixels.resize(static_cast<size_t>(width) * height);
+  bool gray = true;
+  bool opaque = true;
+  for (int y = 0; y < height && (gray || (has_alpha && opaque)); ++y) {
+    if (gray) {
+      uint8_t* out = &pixels[static_cast<size_t>(y) * width];
+      gray = input_color_components == 4
+                 ? pixel_convert::BGRAToGray(row(y), width, out)
+                 : pixel_convert::BGRToGray(row(y), width, out);
+    }
+    if (has_alpha && opaque)
+      opaque = pixel_convert::IsOpaque(row(y), width);
+  }
+
+  uint8_t lookup[256];
+  if (gray && opaque) {
+    bool used[256] = {};
+    for (uint8_t level : pixels)
+      used[level] = true;
+    int gray_bit_depth = GrayBitDepth(used);
+    int levels = static_cast<int>(std::count(used, used + 256, true));
+    // A few levels that are not evenly spaced fit a smaller palette.
+    if (PaletteBitDepth(levels) < gray_bit_depth) {
+      reduced->color_type = PNG_COLOR_TYPE_PALETTE;
+      reduced->bit_depth = PaletteBitDepth(levels);
+      for (int level = 0; level < 256; ++level) {
+        if (!used[level])
+          continue;
+        lookup[level] = static_cast<uint8_t>(reduced->palette.colors.size());
+        png_color color = {static_cast<png_byte>(level),
+                           static_cast<png_byte>(level),
+                           static_cast<png_byte>(level)};
+        reduced->palette.colors.push_back(color);
+      }
+    } else {
+      reduced->color_type = PNG_COLOR_TYPE_GRAY;
+      reduced->bit_depth = gray_bit_depth;
+      int step = 255 / ((1 << gray_bit_depth) - 1);
+      for (int level = 0; level < 256; ++level)
+        lookup[level] = static_cast<uint8_t>(level / step);
+    }
+    PackRows(lookup, width, height, reduced);
+    return Reduction::kReduced;
+  }
+
+  // Up to 256 colors make an indexed image. Colors are looked up in a small
+  // open addressing table, unless a pixel repeats the one before it.
+  const int red = format == FORMAT_BGR || format == FORMAT_BGRA ? 2 : 0;
+  constexpr int kTableBits = 10;
+  constexpr uint32_t kTableMask = (1u << kTableBits) - 1;
+  std::vector<uint32_t> keys(kTableMask + 1);
+  std::vector<int> entries(kTableMask + 1, -1);
+  std::vector<uint32_t> colors;
+  bool fits = true;
+  uint32_t last_key = 0;
+  int last_entry = -1;
+  for (int y = 0; y < height && fits; ++y) {
+    const uint8_t* in = row(y);
+    uint8_t* out = &pixels[static_cast<size_t>(y) * width];
+    for (int x = 0; x < width; ++x, in += input_color_components) {
+      uint32_t key = in[red] | in[1] << 8 | in[2 - red] << 16 |
+                     static_cast<uint32_t>(has_alpha ? in[3] : 0xff) << 24;
+      if (key != last_key || last_entry < 0) {
+        uint32_t slot = (key * 2654435761u) >> (32 - kTableBits);
+        while (entries[slot] >= 0 && keys[slot] != key)
+          slot = (slot + 1) & kTableMask;
+        if (entries[slot] < 0) {
+          if (colors.size() == kMaxPaletteSize) {
+            fits = false;
+            break;
+          }
+          keys[slot] = key;
+          entries[slot] = static_cast<int>(colors.size());
+          colors.push_back(key);
+        }
+        last_key = key;
+        last_entry = entries[slot];
+      }
+      out[x] = static_cast<uint8_t>(last_entry);
+    }
+  }
+  if (fits) {
+    reduced->color_type = PNG_COLOR_TYPE_PALETTE;
+    reduced->bit_depth = PaletteBitDepth(static_cast<int>(colors.size()));
+    for (uint32_t key : colors) {
+      png_color color = {static_cast<png_byte>(key),
+                         static_cast<png_byte>(key >> 8),
+                         static_cast<png_byte>(key >> 16)};
+      reduced->palette.colors.push_back(color);
+      if (!opaque)
+        reduced->palette.alphas.push_back(static_cast<uint8_t>(key >> 24));
+    }
+    for (int i = 0; i < 256; ++i)
+      lookup[i] = static_cast<uint8_t>(i);
+    PackRows(lookup, width, height, reduced);
+    return Reduction::kReduced;
+  }
+
+  if (gray && has_alpha && !opaque) {
+    reduced->color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+    reduced->channels = 2;
+    reduced->row_bytes = width * 2;
+    pixels.resize(static_cast<size_t>(reduced->row_bytes) * height);
+    for (int y = 0; y < height; ++y) {
+      const uint8_t* in = row(y);
+      uint8_t* out = &pixels[static_cast<size_t>(y) * reduced->row_bytes];
+      for (int x = 0; x < width; ++x) {
+        out[x * 2] = in[x * 4 + 1];
+        out[x * 2 + 1] = in[x * 4 + 3];
+      }
+    }
+    return Reduction::kReduced;
+  }
+  return has_alpha && opaque ? Reduction::kOpaque : Reduction::kNone;
+}
+
+// Encodes rows of |row_byte_width| bytes, made into |png_output_color_type|
+// rows by |converter| unless that is nullptr, with fast_png, on the parallel
+// encoder or with libpng.
+std::vector<uint8_t> EncodeRows(pdfium::span<const uint8_t> input,
+                                int width,
+                                int height,
+                                int row_byte_width,
+                                int png_output_color_type,
+                                int bit_depth,
+                                int output_color_components,
+                                const PngPalette* palette,
+                                FormatConverter converter,
+                                const std::vector<Comment>& comments,
+                                const EncodeOptions& options) {
+  std::vector<uint8_t> output;
+  if (options.encoder == PngEncoder::kFast && comments.empty()) {
+    return EncodeFast(input, width, height, row_byte_width,
+                      png_output_color_type, bit_depth,
+                      output_color_components, palette, converter, options);
+  }
+  if (options.threads > 1 && comments.empty() &&
+      height >= 2 * kMinRowsPerParallelBand) {
+    return EncodeParallel(input, width, height, row_byte_width,
+                          png_output_color_type, bit_depth,
+                          output_color_components, palette, converter,
+                          options);
+  }
+
+  png_struct* png_ptr =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  if (!png_ptr)
+    return output;
+  png_info* info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr) {
+    png_destroy_write_struct(&png_ptr, nullptr);
+    return output;
+  }
+
+  PngEncoderState state(&output);
+  bool success = DoLibpngWrite(
+      png_ptr, info_ptr, &state, width, height, row_byte_width, input,
+      options, png_output_color_type, bit_depth,
+      output_color_components, palette, converter, comments);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+
+  if (!success)
+    output.clear();
+  return output;
+}
+
+std::vector<uint8_t> EncodeWithOptions(pdfium::span<const uint8_t> input,
+                                       ColorFormat format,
+                                       const int width,
+                                       const int height,
+                                       int row_byte_width,
+                                       bool discard_transparency,
+                                       const std::vector<Comment>& comments,
+                                       const EncodeOptions& options) {
+  std::vector<uint8_t> output;
+
+  if (options.reduce_colors && comments.empty() && format != FORMAT_GRAY) {
+    ReducedImage reduced;
+    switch (ReduceColors(input, format, width, height, row_byte_width,
+                         discard_transparency, &reduced)) {
+      case Reduction::kNone:
+        break;
+      case Reduction::kOpaque:
+        discard_transparency = true;
+        break;
+      case Reduction::kReduced:
+        return EncodeRows(reduced.pixels, width, height, reduced.row_bytes,
+                          reduced.color_type, reduced.bit_depth,
+                          reduced.channels,
+                          reduced.color_type == PNG_COLOR_TYPE_PALETTE
+                              ? &reduced.palette
+                              : nullptr,
+                          nullptr, comments, options);
+    }
+  }
 
   // Run to convert an input row into the output row format, nullptr means no
   // conversion is necessary.
@@ -632,26 +1329,10 @@ std::vector<uint8_t> EncodeWithCompressionLevel(
   if (row_byte_width < input_color_components * width)
     return output;
 
-  png_struct* png_ptr =
-      png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
-  if (!png_ptr)
-    return output;
-  png_info* info_ptr = png_create_info_struct(png_ptr);
-  if (!info_ptr) {
-    png_destroy_write_struct(&png_ptr, nullptr);
-    return output;
-  }
-
-  PngEncoderState state(&output);
-  bool success =
-      DoLibpngWrite(png_ptr, info_ptr, &state, width, height, row_byte_width,
-                    input, compression_level, png_output_color_type,
-                    output_color_components, converter, comments);
-  png_destroy_write_struct(&png_ptr, &info_ptr);
-
-  if (!success)
-    output.clear();
-  return output;
+  return EncodeRows(input, width, height, row_byte_width,
+                    png_output_color_type, /*bit_depth=*/8,
+                    output_color_components, /*palette=*/nullptr, converter,
+                    comments, options);
 }
 
 std::vector<uint8_t> Encode(pdfium::span<const uint8_t> input,
@@ -661,13 +1342,178 @@ std::vector<uint8_t> Encode(pdfium::span<const uint8_t> input,
                             int row_byte_width,
                             bool discard_transparency,
                             const std::vector<Comment>& comments) {
-  return EncodeWithCompressionLevel(input, format, width, height,
-                                    row_byte_width, discard_transparency,
-                                    comments, Z_DEFAULT_COMPRESSION);
+  return EncodeWithOptions(input, format, width, height, row_byte_width,
+                           discard_transparency, comments, EncodeOptions());
+}
+
+// Row writer
+//
+// The same libpng calls as DoLibpngWrite(), spread over the calls of
+// BGRAPNGRowWriter. Each step has its own setjmp().
+
+bool DoLibpngWriteHeader(png_struct* png_ptr,
+                         png_info* info_ptr,
+                         FILE* file,
+                         int width,
+                         int height,
+                         const EncodeOptions& options,
+                         int png_output_color_type) {
+  if (setjmp(png_jmpbuf(png_ptr)))
+    return false;
+
+  // The default limits are meant for reading untrusted images.
+  png_set_user_limits(png_ptr, PNG_UINT_31_MAX, PNG_UINT_31_MAX);
+  SetLibpngCompression(png_ptr, options);
+  png_init_io(png_ptr, file);
+  png_set_IHDR(png_ptr, info_ptr, width, height, 8, png_output_color_type,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+  return true;
+}
+
+bool DoLibpngWriteRows(png_struct* png_ptr,
+                       const uint8_t* input,
+                       int width,
+                       int rows,
+                       int row_byte_width,
+                       FormatConverter converter,
+                       uint8_t* row_buffer) {
+  if (setjmp(png_jmpbuf(png_ptr)))
+    return false;
+
+  for (int y = 0; y < rows; y++) {
+    const uint8_t* row = &input[static_cast<size_t>(y) * row_byte_width];
+    if (converter) {
+      converter(row, width, row_buffer, nullptr);
+      row = row_buffer;
+    }
+    png_write_row(png_ptr, const_cast<uint8_t*>(row));
+  }
+  return true;
+}
+
+bool DoLibpngWriteEnd(png_struct* png_ptr, png_info* info_ptr) {
+  if (setjmp(png_jmpbuf(png_ptr)))
+    return false;
+
+  png_write_end(png_ptr, info_ptr);
+  return true;
 }
 
 }  // namespace
 
+struct BGRAPNGRowWriter::State {
+  ~State() {
+    if (png_ptr)
+      png_destroy_write_struct(&png_ptr, info_ptr ? &info_ptr : nullptr);
+    if (file)
+      fclose(file);
+  }
+
+  std::string filename;
+  FILE* file = nullptr;
+  png_struct* png_ptr = nullptr;
+  png_info* info_ptr = nullptr;
+  int width = 0;
+  int height = 0;
+  int rows_written = 0;
+  FormatConverter converter = nullptr;
+  std::vector<uint8_t> row_buffer;
+  bool failed = false;
+};
+
+BGRAPNGRowWriter::BGRAPNGRowWriter() = default;
+
+BGRAPNGRowWriter::~BGRAPNGRowWriter() = default;
+
+bool BGRAPNGRowWriter::Open(const std::string& filename,
+                            int width,
+                            int height,
+                            bool discard_transparency,
+                            const EncodeOptions& options) {
+  state_.reset(new State);
+  State* state = state_.get();
+  state->filename = filename;
+  state->width = width;
+  state->height = height;
+  state->failed = true;
+  if (width <= 0 || height <= 0)
+    return false;
+
+  state->file = fopen(filename.c_str(), "wb");
+  if (!state->file) {
+    fprintf(stderr, "Failed to open %s for output\n", filename.c_str());
+    return false;
+  }
+  state->png_ptr =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  if (!state->png_ptr)
+    return false;
+  state->info_ptr = png_create_info_struct(state->png_ptr);
+  if (!state->info_ptr)
+    return false;
+
+  int output_color_components = discard_transparency ? 3 : 4;
+  if (options.rgb_order)
+    state->converter = discard_transparency ? ConvertRGBAtoRGB : nullptr;
+  else
+    state->converter =
+        discard_transparency ? ConvertBGRAtoRGB : ConvertBetweenBGRAandRGBA;
+  if (state->converter) {
+    state->row_buffer.resize(static_cast<size_t>(width) *
+                             output_color_components);
+  }
+  if (!DoLibpngWriteHeader(
+          state->png_ptr, state->info_ptr, state->file, width, height,
+          options,
+          discard_transparency ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA)) {
+    return false;
+  }
+  state->failed = false;
+  return true;
+}
+
+bool BGRAPNGRowWriter::WriteRows(pdfium::span<const uint8_t> input,
+                                 int rows,
+                                 int row_byte_width) {
+  State* state = state_.get();
+  if (!state || state->failed)
+    return false;
+  if (rows < 0 || rows > state->height - state->rows_written ||
+      row_byte_width < state->width * 4 ||
+      (rows > 0 &&
+       input.size() < static_cast<size_t>(rows - 1) * row_byte_width +
+                          state->width * 4)) {
+    state->failed = true;
+    return false;
+  }
+  if (!DoLibpngWriteRows(state->png_ptr, input.data(), state->width, rows,
+                         row_byte_width, state->converter,
+                         state->row_buffer.data())) {
+    state->failed = true;
+    return false;
+  }
+  state->rows_written += rows;
+  return true;
+}
+
+bool BGRAPNGRowWriter::Finish() {
+  State* state = state_.get();
+  if (!state)
+    return false;
+  bool success = !state->failed && state->rows_written == state->height &&
+                 DoLibpngWriteEnd(state->png_ptr, state->info_ptr);
+  FILE* file = state->file;
+  state->file = nullptr;
+  if (file && fclose(file) != 0)
+    success = false;
+  if (!success)
+    fprintf(stderr, "Failed to write to %s\n", state->filename.c_str());
+  state_.reset();
+  return success;
+}
+
 std::vector<uint8_t> DecodePNG(pdfium::span<const uint8_t> input,
                                bool reverse_byte_order,
                                int* width,
@@ -684,6 +1530,16 @@ std::vector<uint8_t> EncodeBGRPNG(pdfium::span<const uint8_t> input,
                 std::vector<Comment>());
 }
 
+std::vector<uint8_t> EncodeBGRPNG(pdfium::span<const uint8_t> input,
+                                  int width,
+                                  int height,
+                                  int row_byte_width,
+                                  const EncodeOptions& options) {
+  return EncodeWithOptions(input, options.rgb_order ? FORMAT_RGB : FORMAT_BGR,
+                           width, height, row_byte_width, false,
+                           std::vector<Comment>(), options);
+}
+
 std::vector<uint8_t> EncodeRGBAPNG(pdfium::span<const uint8_t> input,
                                    int width,
                                    int height,
@@ -701,6 +1557,38 @@ std::vector<uint8_t> EncodeBGRAPNG(pdfium::span<const uint8_t> input,
                 discard_transparency, std::vector<Comment>());
 }
 
+std::vector<uint8_t> EncodeBGRAPNG(pdfium::span<const uint8_t> input,
+                                   int width,
+                                   int height,
+                                   int row_byte_width,
+                                   bool discard_transparency,
+                                   const EncodeOptions& options) {
+  return EncodeWithOptions(input,
+                           options.rgb_order ? FORMAT_RGBA : FORMAT_BGRA,
+                           width, height, row_byte_width,
+                           discard_transparency, std::vector<Comment>(),
+                           options);
+}
+
+bool ApplyEncodePreset(const std::string& name, EncodeOptions* options) {
+  // Rendered pages are mostly flat color and text, which compress best
+  // unfiltered; the Up filter still pays off on images.
+  options->strategy = DeflateStrategy::kAuto;
+  if (name == "fast") {
+    options->compression_level = 1;
+    options->filters = kFilterNone;
+  } else if (name == "balanced") {
+    options->compression_level = 4;
+    options->filters = kFilterNone | kFilterUp;
+  } else if (name == "small") {
+    options->compression_level = 9;
+    options->filters = 0;
+  } else {
+    return false;
+  }
+  return true;
+}
+
 std::vector<uint8_t> EncodeGrayPNG(pdfium::span<const uint8_t> input,
                                    int width,
                                    int height,
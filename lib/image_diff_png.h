@@ -7,12 +7,66 @@
 
 #include <stdlib.h>  // for size_t.
 
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "lib/span.h"
 
 namespace image_diff_png {
 
+// zlib strategies, see deflateInit2(). kAuto leaves the choice to the
+// encoder; libpng takes Z_FILTERED for filtered rows.
+enum class DeflateStrategy { kAuto, kDefault, kFiltered, kRle, kHuffmanOnly };
+
+// PNG row filters, bit n standing for filter type n.
+constexpr int kFilterNone = 1 << 0;
+constexpr int kFilterSub = 1 << 1;
+constexpr int kFilterUp = 1 << 2;
+constexpr int kFilterAverage = 1 << 3;
+constexpr int kFilterPaeth = 1 << 4;
+constexpr int kAllFilters = 0x1f;
+
+// The compressors behind the encoders of whole images. kFast is fast_png,
+// made for rendered pages, which ignores the zlib settings.
+// BGRAPNGRowWriter always writes with libpng.
+enum class PngEncoder { kLibpng, kFast };
+
+// Settings for the encoders that take them.
+struct EncodeOptions {
+  PngEncoder encoder = PngEncoder::kLibpng;
+
+  // zlib compression level, -1 is Z_DEFAULT_COMPRESSION.
+  int compression_level = -1;
+
+  DeflateStrategy strategy = DeflateStrategy::kAuto;
+
+  // The kFilter* filters rows may use; each row gets the one of them that
+  // looks best. 0 leaves the choice to the encoder.
+  int filters = 0;
+
+  // When above 1, the image is split into row bands that are filtered and
+  // deflated on that many threads and stitched into one IDAT stream.
+  int threads = 1;
+
+  // The input of the BGR and BGRA encoders is in RGB or RGBA order instead,
+  // as PDFium renders it with FPDF_REVERSE_BYTE_ORDER. Such rows go to libpng
+  // as they are, without a conversion pass.
+  bool rgb_order = false;
+
+  // Writes the image in the smallest PNG color type and bit depth that holds
+  // its pixels exactly: gray or indexed with 1, 2, 4 or 8 bits per pixel,
+  // gray with alpha, or RGB for an opaque image with alpha. Costs a scan of
+  // the image. BGRAPNGRowWriter, which never has the whole image, ignores it.
+  bool reduce_colors = false;
+};
+
+// Sets the compression settings of |options| to those of the named preset:
+// "fast" is level 1 without filters, "balanced" level 4 with the None and Up
+// filters, "small" level 9 with the encoder's choice of filters. Returns false
+// for other names.
+bool ApplyEncodePreset(const std::string& name, EncodeOptions* options);
+
 // Decode a PNG into an RGBA pixel array, or BGRA pixel array if
 // |reverse_byte_order| is set to true.
 std::vector<uint8_t> DecodePNG(pdfium::span<const uint8_t> input,
@@ -20,11 +74,17 @@ std::vector<uint8_t> DecodePNG(pdfium::span<const uint8_t> input,
                                int* width,
                                int* height);
 
-// Encode a BGR pixel array into a PNG.
+// Encode a BGR pixel array into a PNG. With |options.rgb_order| the array is
+// RGB.
 std::vector<uint8_t> EncodeBGRPNG(pdfium::span<const uint8_t> input,
                                   int width,
                                   int height,
                                   int row_byte_width);
+std::vector<uint8_t> EncodeBGRPNG(pdfium::span<const uint8_t> input,
+                                  int width,
+                                  int height,
+                                  int row_byte_width,
+                                  const EncodeOptions& options);
 
 // Encode an RGBA pixel array into a PNG.
 std::vector<uint8_t> EncodeRGBAPNG(pdfium::span<const uint8_t> input,
@@ -32,12 +92,19 @@ std::vector<uint8_t> EncodeRGBAPNG(pdfium::span<const uint8_t> input,
                                    int height,
                                    int row_byte_width);
 
-// Encode an BGRA pixel array into a PNG.
+// Encode an BGRA pixel array into a PNG. With |options.rgb_order| the array
+// is RGBA.
 std::vector<uint8_t> EncodeBGRAPNG(pdfium::span<const uint8_t> input,
                                    int width,
                                    int height,
                                    int row_byte_width,
                                    bool discard_transparency);
+std::vector<uint8_t> EncodeBGRAPNG(pdfium::span<const uint8_t> input,
+                                   int width,
+                                   int height,
+                                   int row_byte_width,
+                                   bool discard_transparency,
+                                   const EncodeOptions& options);
 
 // Encode a grayscale pixel array into a PNG.
 std::vector<uint8_t> EncodeGrayPNG(pdfium::span<const uint8_t> input,
@@ -45,6 +112,41 @@ std::vector<uint8_t> EncodeGrayPNG(pdfium::span<const uint8_t> input,
                                    int height,
                                    int row_byte_width);
 
+// Writes a BGRA image, or an RGBA one with |options.rgb_order|, to a PNG
+// file as its rows arrive, so that only the rows at hand have to be in
+// memory. The file is encoded like EncodeBGRAPNG() with a single thread
+// would. A file that is not finished is left incomplete.
+class BGRAPNGRowWriter {
+ public:
+  BGRAPNGRowWriter();
+  ~BGRAPNGRowWriter();
+
+  BGRAPNGRowWriter(const BGRAPNGRowWriter&) = delete;
+  BGRAPNGRowWriter& operator=(const BGRAPNGRowWriter&) = delete;
+
+  // Creates |filename| for an image of |width| x |height| pixels and writes
+  // the header. Returns false on failure.
+  bool Open(const std::string& filename,
+            int width,
+            int height,
+            bool discard_transparency,
+            const EncodeOptions& options);
+
+  // Appends |rows| rows from |input|, |row_byte_width| bytes apart. Returns
+  // false on failure, after which every other call fails too.
+  bool WriteRows(pdfium::span<const uint8_t> input,
+                 int rows,
+                 int row_byte_width);
+
+  // Ends the image and closes the file. Returns false if anything failed or
+  // not all rows were written.
+  bool Finish();
+
+ private:
+  struct State;
+  std::unique_ptr<State> state_;
+};
+
 }  // namespace image_diff_png
 
 #endif  // TESTING_IMAGE_DIFF_IMAGE_DIFF_PNG_H_
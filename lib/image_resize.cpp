@@ -0,0 +1,190 @@
+#include "lib/image_resize.h"
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace image_resize {
+
+namespace {
+
+// Averages the four BGRA pixels |a|, |b|, |c| and |d| into |out|.
+inline void AverageBGRA(const uint8_t* a,
+                        const uint8_t* b,
+                        const uint8_t* c,
+                        const uint8_t* d,
+                        bool has_alpha,
+                        uint8_t* out) {
+  if (!has_alpha) {
+    for (int i = 0; i < 4; ++i)
+      out[i] = static_cast<uint8_t>((a[i] + b[i] + c[i] + d[i] + 2) >> 2);
+    return;
+  }
+  unsigned alpha = a[3] + b[3] + c[3] + d[3];
+  if (alpha == 4 * 255) {
+    for (int i = 0; i < 3; ++i)
+      out[i] = static_cast<uint8_t>((a[i] + b[i] + c[i] + d[i] + 2) >> 2);
+    out[3] = 255;
+    return;
+  }
+  if (alpha == 0) {
+    out[0] = out[1] = out[2] = out[3] = 0;
+    return;
+  }
+  for (int i = 0; i < 3; ++i) {
+    unsigned sum = a[i] * a[3] + b[i] * b[3] + c[i] * c[3] + d[i] * d[3];
+    out[i] = static_cast<uint8_t>((sum + alpha / 2) / alpha);
+  }
+  out[3] = static_cast<uint8_t>((alpha + 2) >> 2);
+}
+
+// The input pixels that make up each output pixel along one axis, and their
+// weights, which add up to 1.
+struct AreaWeights {
+  // First input pixel of each output pixel.
+  std::vector<int> first;
+  // Output pixel i uses weights[offset[i]] up to weights[offset[i + 1]].
+  std::vector<size_t> offset;
+  std::vector<float> weights;
+};
+
+AreaWeights ComputeAreaWeights(int input_size, int output_size) {
+  AreaWeights result;
+  result.first.resize(output_size);
+  result.offset.resize(output_size + 1);
+  double ratio = static_cast<double>(input_size) / output_size;
+  for (int i = 0; i < output_size; ++i) {
+    double start = i * ratio;
+    double end = std::min((i + 1) * ratio, static_cast<double>(input_size));
+    int first = std::min(static_cast<int>(start), input_size - 1);
+    result.first[i] = first;
+    result.offset[i] = result.weights.size();
+    for (int j = first; j < end; ++j) {
+      double covered = std::min(end, j + 1.0) - std::max(start, static_cast<double>(j));
+      result.weights.push_back(static_cast<float>(covered / (end - start)));
+    }
+  }
+  result.offset[output_size] = result.weights.size();
+  return result;
+}
+
+inline uint8_t ToByte(float value) {
+  return static_cast<uint8_t>(std::min(std::max(value + 0.5f, 0.f), 255.f));
+}
+
+// Area averaging for pixels of |kChannels| bytes; only four byte pixels can
+// have alpha.
+template <int kChannels>
+void ResizeArea(const uint8_t* input,
+                int width,
+                int height,
+                int input_stride,
+                bool has_alpha,
+                uint8_t* output,
+                int output_width,
+                int output_height,
+                int output_stride) {
+  AreaWeights columns = ComputeAreaWeights(width, output_width);
+  AreaWeights rows = ComputeAreaWeights(height, output_height);
+
+  // Each output row first sums its input rows into |sums|, then its columns.
+  // Both loops run over contiguous floats, which the compiler vectorizes.
+  const size_t row_size = static_cast<size_t>(width) * kChannels;
+  std::vector<float> sums(row_size);
+  for (int y = 0; y < output_height; ++y) {
+    std::fill(sums.begin(), sums.end(), 0.f);
+    for (size_t k = rows.offset[y]; k < rows.offset[y + 1]; ++k) {
+      const float weight = rows.weights[k];
+      const uint8_t* row =
+          input + static_cast<size_t>(rows.first[y] + k - rows.offset[y]) *
+                      input_stride;
+      if (has_alpha) {
+        for (size_t i = 0; i < row_size; i += 4) {
+          float alpha = row[i + 3] * weight;
+          sums[i] += row[i] * alpha;
+          sums[i + 1] += row[i + 1] * alpha;
+          sums[i + 2] += row[i + 2] * alpha;
+          sums[i + 3] += alpha;
+        }
+      } else {
+        for (size_t i = 0; i < row_size; ++i)
+          sums[i] += row[i] * weight;
+      }
+    }
+
+    uint8_t* out = output + static_cast<size_t>(y) * output_stride;
+    for (int x = 0; x < output_width; ++x) {
+      float pixel[kChannels] = {};
+      const float* in =
+          sums.data() + static_cast<size_t>(columns.first[x]) * kChannels;
+      for (size_t k = columns.offset[x]; k < columns.offset[x + 1]; ++k) {
+        const float weight = columns.weights[k];
+        for (int c = 0; c < kChannels; ++c)
+          pixel[c] += in[c] * weight;
+        in += kChannels;
+      }
+      if (has_alpha) {
+        float alpha = pixel[3];
+        for (int c = 0; c < 3; ++c)
+          out[c] = alpha > 0 ? ToByte(pixel[c] / alpha) : 0;
+        out[3] = ToByte(alpha);
+      } else {
+        for (int c = 0; c < kChannels; ++c)
+          out[c] = ToByte(pixel[c]);
+      }
+      out += kChannels;
+    }
+  }
+}
+
+}  // namespace
+
+void DownsampleBGRA2x(const uint8_t* input,
+                      int width,
+                      int height,
+                      int input_stride,
+                      bool has_alpha,
+                      uint8_t* output,
+                      int output_stride) {
+  int output_width = (width + 1) / 2;
+  int output_height = (height + 1) / 2;
+  for (int y = 0; y < output_height; ++y) {
+    const uint8_t* row0 = input + static_cast<size_t>(2 * y) * input_stride;
+    const uint8_t* row1 = 2 * y + 1 < height ? row0 + input_stride : row0;
+    uint8_t* out = output + static_cast<size_t>(y) * output_stride;
+    for (int x = 0; x < output_width; ++x) {
+      int left = 8 * x;
+      int right = 2 * x + 1 < width ? left + 4 : left;
+      AverageBGRA(row0 + left, row0 + right, row1 + left, row1 + right,
+                  has_alpha, out + 4 * x);
+    }
+  }
+}
+
+void ResizeBGRAArea(const uint8_t* input,
+                    int width,
+                    int height,
+                    int input_stride,
+                    bool has_alpha,
+                    uint8_t* output,
+                    int output_width,
+                    int output_height,
+                    int output_stride) {
+  ResizeArea<4>(input, width, height, input_stride, has_alpha, output,
+                output_width, output_height, output_stride);
+}
+
+void ResizeBGRArea(const uint8_t* input,
+                   int width,
+                   int height,
+                   int input_stride,
+                   uint8_t* output,
+                   int output_width,
+                   int output_height,
+                   int output_stride) {
+  ResizeArea<3>(input, width, height, input_stride, /*has_alpha=*/false,
+                output, output_width, output_height, output_stride);
+}
+
+}  // namespace image_resize
@@ -0,0 +1,48 @@
+#ifndef LIB_IMAGE_RESIZE_H_
+#define LIB_IMAGE_RESIZE_H_
+
+#include <stdint.h>
+
+namespace image_resize {
+
+// Halves a BGRA image in both directions by averaging blocks of 2x2 pixels
+// into |output|, which holds (width + 1) / 2 x (height + 1) / 2 pixels. An
+// odd last column or row is averaged with itself. With |has_alpha|, colors
+// are weighted by alpha, so transparent pixels do not darken their
+// neighbours; otherwise the fourth byte is averaged like a color.
+void DownsampleBGRA2x(const uint8_t* input,
+                      int width,
+                      int height,
+                      int input_stride,
+                      bool has_alpha,
+                      uint8_t* output,
+                      int output_stride);
+
+// Scales a BGRA image to |output_width| x |output_height| pixels by area
+// averaging: each output pixel is the mean of the input pixels under it, the
+// ones on its edges weighted by how much of them it covers. With |has_alpha|,
+// colors are weighted by alpha like above; otherwise the fourth byte is
+// averaged like a color.
+void ResizeBGRAArea(const uint8_t* input,
+                    int width,
+                    int height,
+                    int input_stride,
+                    bool has_alpha,
+                    uint8_t* output,
+                    int output_width,
+                    int output_height,
+                    int output_stride);
+
+// The same for three byte pixels without alpha, BGR or RGB.
+void ResizeBGRArea(const uint8_t* input,
+                   int width,
+                   int height,
+                   int input_stride,
+                   uint8_t* output,
+                   int output_width,
+                   int output_height,
+                   int output_stride);
+
+}  // namespace image_resize
+
+#endif  // LIB_IMAGE_RESIZE_H_
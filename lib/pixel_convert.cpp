@@ -0,0 +1,518 @@
+#include "lib/pixel_convert.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+    defined(_M_IX86)
+#define PIXEL_CONVERT_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define TARGET(isa)
+#else
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PIXEL_CONVERT_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace pixel_convert {
+
+namespace {
+
+typedef void (*RowConverter)(const uint8_t* input,
+                             int width,
+                             uint8_t* output);
+typedef bool (*GrayConverter)(const uint8_t* input,
+                              int width,
+                              uint8_t* output);
+typedef bool (*RowCheck)(const uint8_t* input, int width);
+
+struct Converters {
+  const char* name;
+  RowConverter swap_red_blue;
+  RowConverter bgra_to_rgb;
+  RowConverter rgba_to_rgb;
+  RowConverter bgr_to_rgb;
+  RowConverter rgb_to_bgra;
+  GrayConverter bgra_to_gray;
+  GrayConverter bgr_to_gray;
+  RowCheck is_opaque;
+};
+
+// The scalar versions convert any pixels the vector versions leave over.
+
+void SwapRedBlueScalar(const uint8_t* input, int width, uint8_t* output) {
+  for (int x = 0; x < width; x++) {
+    const uint8_t* pixel_in = &input[x * 4];
+    uint8_t* pixel_out = &output[x * 4];
+    pixel_out[0] = pixel_in[2];
+    pixel_out[1] = pixel_in[1];
+    pixel_out[2] = pixel_in[0];
+    pixel_out[3] = pixel_in[3];
+  }
+}
+
+void BGRAToRGBScalar(const uint8_t* input, int width, uint8_t* output) {
+  for (int x = 0; x < width; x++) {
+    const uint8_t* pixel_in = &input[x * 4];
+    uint8_t* pixel_out = &output[x * 3];
+    pixel_out[0] = pixel_in[2];
+    pixel_out[1] = pixel_in[1];
+    pixel_out[2] = pixel_in[0];
+  }
+}
+
+void RGBAToRGBScalar(const uint8_t* input, int width, uint8_t* output) {
+  for (int x = 0; x < width; x++)
+    memcpy(&output[x * 3], &input[x * 4], 3);
+}
+
+void BGRToRGBScalar(const uint8_t* input, int width, uint8_t* output) {
+  for (int x = 0; x < width; x++) {
+    const uint8_t* pixel_in = &input[x * 3];
+    uint8_t* pixel_out = &output[x * 3];
+    pixel_out[0] = pixel_in[2];
+    pixel_out[1] = pixel_in[1];
+    pixel_out[2] = pixel_in[0];
+  }
+}
+
+void RGBToBGRAScalar(const uint8_t* input, int width, uint8_t* output) {
+  for (int x = 0; x < width; x++) {
+    const uint8_t* pixel_in = &input[x * 3];
+    uint8_t* pixel_out = &output[x * 4];
+    pixel_out[0] = pixel_in[2];
+    pixel_out[1] = pixel_in[1];
+    pixel_out[2] = pixel_in[0];
+    pixel_out[3] = 0xff;
+  }
+}
+
+bool BGRAToGrayScalar(const uint8_t* input, int width, uint8_t* output) {
+  unsigned differences = 0;
+  for (int x = 0; x < width; x++) {
+    const uint8_t* pixel_in = &input[x * 4];
+    differences |= (pixel_in[0] ^ pixel_in[1]) | (pixel_in[1] ^ pixel_in[2]);
+    output[x] = pixel_in[1];
+  }
+  return !differences;
+}
+
+bool BGRToGrayScalar(const uint8_t* input, int width, uint8_t* output) {
+  unsigned differences = 0;
+  for (int x = 0; x < width; x++) {
+    const uint8_t* pixel_in = &input[x * 3];
+    differences |= (pixel_in[0] ^ pixel_in[1]) | (pixel_in[1] ^ pixel_in[2]);
+    output[x] = pixel_in[1];
+  }
+  return !differences;
+}
+
+bool IsOpaqueScalar(const uint8_t* input, int width) {
+  unsigned alpha = 0xff;
+  for (int x = 0; x < width; x++)
+    alpha &= input[x * 4 + 3];
+  return alpha == 0xff;
+}
+
+const Converters kScalarConverters = {
+    "scalar",         SwapRedBlueScalar, BGRAToRGBScalar,
+    RGBAToRGBScalar,  BGRToRGBScalar,    RGBToBGRAScalar,
+    BGRAToGrayScalar, BGRToGrayScalar,   IsOpaqueScalar,
+};
+
+#ifdef PIXEL_CONVERT_X86
+
+inline __m128i Load128(const uint8_t* p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+inline void Store128(uint8_t* p, __m128i v) {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+}
+
+TARGET("ssse3")
+void SwapRedBlueSSSE3(const uint8_t* input, int width, uint8_t* output) {
+  const __m128i shuffle =
+      _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  int x = 0;
+  for (; x + 4 <= width; x += 4) {
+    size_t offset = static_cast<size_t>(x) * 4;
+    Store128(output + offset, _mm_shuffle_epi8(Load128(input + offset), shuffle));
+  }
+  SwapRedBlueScalar(input + x * 4, width - x, output + x * 4);
+}
+
+// Packs 16 four byte pixels at a time into three bytes each, picked by
+// |shuffle| from the first 12 lanes; the other 4 lanes of it are zeroed.
+TARGET("ssse3")
+int Pack4To3SSSE3(const uint8_t* input,
+                  int width,
+                  uint8_t* output,
+                  __m128i shuffle) {
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const uint8_t* in = input + static_cast<size_t>(x) * 4;
+    uint8_t* out = output + static_cast<size_t>(x) * 3;
+    __m128i a = _mm_shuffle_epi8(Load128(in), shuffle);
+    __m128i b = _mm_shuffle_epi8(Load128(in + 16), shuffle);
+    __m128i c = _mm_shuffle_epi8(Load128(in + 32), shuffle);
+    __m128i d = _mm_shuffle_epi8(Load128(in + 48), shuffle);
+    Store128(out, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+    Store128(out + 16, _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+    Store128(out + 32, _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+  }
+  return x;
+}
+
+TARGET("ssse3")
+void BGRAToRGBSSSE3(const uint8_t* input, int width, uint8_t* output) {
+  int x = Pack4To3SSSE3(
+      input, width, output,
+      _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+  BGRAToRGBScalar(input + x * 4, width - x, output + x * 3);
+}
+
+TARGET("ssse3")
+void RGBAToRGBSSSE3(const uint8_t* input, int width, uint8_t* output) {
+  int x = Pack4To3SSSE3(
+      input, width, output,
+      _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+  RGBAToRGBScalar(input + x * 4, width - x, output + x * 3);
+}
+
+// Five pixels per 16 byte load and store. The 16th byte is stored as it was
+// read and overwritten by the next round, which is why one more pixel than
+// converted has to follow.
+TARGET("ssse3")
+void BGRToRGBSSSE3(const uint8_t* input, int width, uint8_t* output) {
+  const __m128i shuffle =
+      _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+  int x = 0;
+  for (; x + 6 <= width; x += 5) {
+    size_t offset = static_cast<size_t>(x) * 3;
+    Store128(output + offset, _mm_shuffle_epi8(Load128(input + offset), shuffle));
+  }
+  BGRToRGBScalar(input + x * 3, width - x, output + x * 3);
+}
+
+// Four pixels per round from a 16 byte load, of which 12 bytes are used.
+TARGET("ssse3")
+void RGBToBGRASSSE3(const uint8_t* input, int width, uint8_t* output) {
+  const __m128i shuffle =
+      _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+  const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xff000000));
+  int x = 0;
+  for (; x + 6 <= width; x += 4) {
+    __m128i pixels =
+        _mm_shuffle_epi8(Load128(input + static_cast<size_t>(x) * 3), shuffle);
+    Store128(output + static_cast<size_t>(x) * 4, _mm_or_si128(pixels, alpha));
+  }
+  RGBToBGRAScalar(input + x * 3, width - x, output + x * 4);
+}
+
+// Sixteen pixels per round. Each pixel is compared with itself shifted down
+// by a byte, which lines up blue with green and green with red.
+TARGET("ssse3")
+bool BGRAToGraySSSE3(const uint8_t* input, int width, uint8_t* output) {
+  const __m128i green =
+      _mm_setr_epi8(1, 5, 9, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i color_pairs = _mm_set1_epi32(0xffff);
+  __m128i differences = _mm_setzero_si128();
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const uint8_t* in = input + static_cast<size_t>(x) * 4;
+    __m128i gray[4];
+    for (int i = 0; i < 4; ++i) {
+      __m128i pixels = Load128(in + i * 16);
+      differences = _mm_or_si128(
+          differences,
+          _mm_and_si128(_mm_xor_si128(pixels, _mm_srli_epi32(pixels, 8)),
+                        color_pairs));
+      gray[i] = _mm_shuffle_epi8(pixels, green);
+    }
+    Store128(output + x,
+             _mm_unpacklo_epi64(_mm_unpacklo_epi32(gray[0], gray[1]),
+                                _mm_unpacklo_epi32(gray[2], gray[3])));
+  }
+  bool is_gray = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                     differences, _mm_setzero_si128())) == 0xffff;
+  return BGRAToGrayScalar(input + x * 4, width - x, output + x) && is_gray;
+}
+
+// Sixteen pixels per round, compared with the same bytes loaded one further
+// on, of which the pairs within a pixel count. That load reads one byte past
+// the pixels of the round, so one more pixel has to follow.
+TARGET("ssse3")
+bool BGRToGraySSSE3(const uint8_t* input, int width, uint8_t* output) {
+  const __m128i pairs[3] = {
+      _mm_setr_epi8(-1, -1, 0, -1, -1, 0, -1, -1, 0, -1, -1, 0, -1, -1, 0, -1),
+      _mm_setr_epi8(-1, 0, -1, -1, 0, -1, -1, 0, -1, -1, 0, -1, -1, 0, -1, -1),
+      _mm_setr_epi8(0, -1, -1, 0, -1, -1, 0, -1, -1, 0, -1, -1, 0, -1, -1, 0),
+  };
+  const __m128i green[3] = {
+      _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+      _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1),
+      _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14),
+  };
+  __m128i differences = _mm_setzero_si128();
+  int x = 0;
+  for (; x + 17 <= width; x += 16) {
+    const uint8_t* in = input + static_cast<size_t>(x) * 3;
+    __m128i gray = _mm_setzero_si128();
+    for (int i = 0; i < 3; ++i) {
+      __m128i pixels = Load128(in + i * 16);
+      __m128i next = Load128(in + i * 16 + 1);
+      differences = _mm_or_si128(
+          differences, _mm_and_si128(_mm_xor_si128(pixels, next), pairs[i]));
+      gray = _mm_or_si128(gray, _mm_shuffle_epi8(pixels, green[i]));
+    }
+    Store128(output + x, gray);
+  }
+  bool is_gray = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                     differences, _mm_setzero_si128())) == 0xffff;
+  return BGRToGrayScalar(input + x * 3, width - x, output + x) && is_gray;
+}
+
+TARGET("ssse3")
+bool IsOpaqueSSSE3(const uint8_t* input, int width) {
+  const __m128i color = _mm_set1_epi32(0xffffff);
+  __m128i alpha = _mm_set1_epi8(-1);
+  int x = 0;
+  for (; x + 4 <= width; x += 4)
+    alpha = _mm_and_si128(alpha, Load128(input + static_cast<size_t>(x) * 4));
+  alpha = _mm_or_si128(alpha, color);
+  bool opaque = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                    alpha, _mm_set1_epi8(-1))) == 0xffff;
+  return opaque && IsOpaqueScalar(input + x * 4, width - x);
+}
+
+// Four byte pixels never cross the 128 bit lanes that AVX2 shuffles within,
+// so only the swap gains from the wider registers.
+TARGET("avx2")
+void SwapRedBlueAVX2(const uint8_t* input, int width, uint8_t* output) {
+  const __m256i shuffle = _mm256_setr_epi8(
+      2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15, 2, 1, 0, 3, 6, 5,
+      4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  int x = 0;
+  for (; x + 8 <= width; x += 8) {
+    size_t offset = static_cast<size_t>(x) * 4;
+    __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + offset));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + offset),
+                        _mm256_shuffle_epi8(v, shuffle));
+  }
+  SwapRedBlueSSSE3(input + x * 4, width - x, output + x * 4);
+}
+
+const Converters kSSSE3Converters = {
+    "ssse3",         SwapRedBlueSSSE3, BGRAToRGBSSSE3,
+    RGBAToRGBSSSE3,  BGRToRGBSSSE3,    RGBToBGRASSSE3,
+    BGRAToGraySSSE3, BGRToGraySSSE3,   IsOpaqueSSSE3,
+};
+
+const Converters kAVX2Converters = {
+    "avx2",          SwapRedBlueAVX2, BGRAToRGBSSSE3,
+    RGBAToRGBSSSE3,  BGRToRGBSSSE3,   RGBToBGRASSSE3,
+    BGRAToGraySSSE3, BGRToGraySSSE3,  IsOpaqueSSSE3,
+};
+
+bool CpuSupports(const char* isa) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info, 1);
+  if (strcmp(isa, "ssse3") == 0)
+    return (info[2] & (1 << 9)) != 0;
+  // AVX2 also needs the OS to save the YMM registers.
+  bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+  __cpuidex(info, 7, 0);
+  return os_saves_ymm && (info[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init();
+  if (strcmp(isa, "ssse3") == 0)
+    return __builtin_cpu_supports("ssse3");
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif  // PIXEL_CONVERT_X86
+
+#ifdef PIXEL_CONVERT_NEON
+
+// NEON loads and stores de-interleave and interleave 16 pixels at a time.
+
+void SwapRedBlueNEON(const uint8_t* input, int width, uint8_t* output) {
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    uint8x16x4_t pixels = vld4q_u8(input + static_cast<size_t>(x) * 4);
+    uint8x16_t blue = pixels.val[0];
+    pixels.val[0] = pixels.val[2];
+    pixels.val[2] = blue;
+    vst4q_u8(output + static_cast<size_t>(x) * 4, pixels);
+  }
+  SwapRedBlueScalar(input + x * 4, width - x, output + x * 4);
+}
+
+void BGRAToRGBNEON(const uint8_t* input, int width, uint8_t* output) {
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    uint8x16x4_t in = vld4q_u8(input + static_cast<size_t>(x) * 4);
+    uint8x16x3_t out = {{in.val[2], in.val[1], in.val[0]}};
+    vst3q_u8(output + static_cast<size_t>(x) * 3, out);
+  }
+  BGRAToRGBScalar(input + x * 4, width - x, output + x * 3);
+}
+
+void RGBAToRGBNEON(const uint8_t* input, int width, uint8_t* output) {
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    uint8x16x4_t in = vld4q_u8(input + static_cast<size_t>(x) * 4);
+    uint8x16x3_t out = {{in.val[0], in.val[1], in.val[2]}};
+    vst3q_u8(output + static_cast<size_t>(x) * 3, out);
+  }
+  RGBAToRGBScalar(input + x * 4, width - x, output + x * 3);
+}
+
+void BGRToRGBNEON(const uint8_t* input, int width, uint8_t* output) {
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    uint8x16x3_t pixels = vld3q_u8(input + static_cast<size_t>(x) * 3);
+    uint8x16_t blue = pixels.val[0];
+    pixels.val[0] = pixels.val[2];
+    pixels.val[2] = blue;
+    vst3q_u8(output + static_cast<size_t>(x) * 3, pixels);
+  }
+  BGRToRGBScalar(input + x * 3, width - x, output + x * 3);
+}
+
+void RGBToBGRANEON(const uint8_t* input, int width, uint8_t* output) {
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    uint8x16x3_t in = vld3q_u8(input + static_cast<size_t>(x) * 3);
+    uint8x16x4_t out = {{in.val[2], in.val[1], in.val[0], vdupq_n_u8(0xff)}};
+    vst4q_u8(output + static_cast<size_t>(x) * 4, out);
+  }
+  RGBToBGRAScalar(input + x * 3, width - x, output + x * 4);
+}
+
+// Folds the bytes of |differences| into one, zero if all of them were.
+inline uint64_t Fold(uint8x16_t differences) {
+  uint64x2_t halves = vreinterpretq_u64_u8(differences);
+  return vgetq_lane_u64(halves, 0) | vgetq_lane_u64(halves, 1);
+}
+
+bool BGRAToGrayNEON(const uint8_t* input, int width, uint8_t* output) {
+  uint8x16_t differences = vdupq_n_u8(0);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    uint8x16x4_t in = vld4q_u8(input + static_cast<size_t>(x) * 4);
+    differences = vorrq_u8(differences, veorq_u8(in.val[0], in.val[1]));
+    differences = vorrq_u8(differences, veorq_u8(in.val[1], in.val[2]));
+    vst1q_u8(output + x, in.val[1]);
+  }
+  bool is_gray = !Fold(differences);
+  return BGRAToGrayScalar(input + x * 4, width - x, output + x) && is_gray;
+}
+
+bool BGRToGrayNEON(const uint8_t* input, int width, uint8_t* output) {
+  uint8x16_t differences = vdupq_n_u8(0);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    uint8x16x3_t in = vld3q_u8(input + static_cast<size_t>(x) * 3);
+    differences = vorrq_u8(differences, veorq_u8(in.val[0], in.val[1]));
+    differences = vorrq_u8(differences, veorq_u8(in.val[1], in.val[2]));
+    vst1q_u8(output + x, in.val[1]);
+  }
+  bool is_gray = !Fold(differences);
+  return BGRToGrayScalar(input + x * 3, width - x, output + x) && is_gray;
+}
+
+bool IsOpaqueNEON(const uint8_t* input, int width) {
+  uint8x16_t alpha = vdupq_n_u8(0xff);
+  int x = 0;
+  for (; x + 16 <= width; x += 16)
+    alpha = vandq_u8(alpha, vld4q_u8(input + static_cast<size_t>(x) * 4).val[3]);
+  bool opaque = !Fold(vmvnq_u8(alpha));
+  return opaque && IsOpaqueScalar(input + x * 4, width - x);
+}
+
+const Converters kNEONConverters = {
+    "neon",         SwapRedBlueNEON, BGRAToRGBNEON,
+    RGBAToRGBNEON,  BGRToRGBNEON,    RGBToBGRANEON,
+    BGRAToGrayNEON, BGRToGrayNEON,   IsOpaqueNEON,
+};
+
+#endif  // PIXEL_CONVERT_NEON
+
+// Returns the converters named |name| if this build and CPU support them, or
+// the best ones for a null |name|.
+const Converters* FindConverters(const char* name) {
+  const Converters* candidates[] = {
+#ifdef PIXEL_CONVERT_X86
+      CpuSupports("avx2") ? &kAVX2Converters : nullptr,
+      CpuSupports("ssse3") ? &kSSSE3Converters : nullptr,
+#endif
+#ifdef PIXEL_CONVERT_NEON
+      &kNEONConverters,
+#endif
+      &kScalarConverters,
+  };
+  for (const Converters* converters : candidates) {
+    if (converters && (!name || strcmp(name, converters->name) == 0))
+      return converters;
+  }
+  return nullptr;
+}
+
+const Converters* g_converters = FindConverters(nullptr);
+
+}  // namespace
+
+void SwapRedBlue(const uint8_t* input, int width, uint8_t* output) {
+  g_converters->swap_red_blue(input, width, output);
+}
+
+void BGRAToRGB(const uint8_t* input, int width, uint8_t* output) {
+  g_converters->bgra_to_rgb(input, width, output);
+}
+
+void RGBAToRGB(const uint8_t* input, int width, uint8_t* output) {
+  g_converters->rgba_to_rgb(input, width, output);
+}
+
+void BGRToRGB(const uint8_t* input, int width, uint8_t* output) {
+  g_converters->bgr_to_rgb(input, width, output);
+}
+
+void RGBToBGRA(const uint8_t* input, int width, uint8_t* output) {
+  g_converters->rgb_to_bgra(input, width, output);
+}
+
+bool BGRAToGray(const uint8_t* input, int width, uint8_t* output) {
+  return g_converters->bgra_to_gray(input, width, output);
+}
+
+bool BGRToGray(const uint8_t* input, int width, uint8_t* output) {
+  return g_converters->bgr_to_gray(input, width, output);
+}
+
+bool IsOpaque(const uint8_t* input, int width) {
+  return g_converters->is_opaque(input, width);
+}
+
+const char* Implementation() {
+  return g_converters->name;
+}
+
+bool SetImplementation(const char* name) {
+  const Converters* converters = FindConverters(name);
+  if (!converters)
+    return false;
+  g_converters = converters;
+  return true;
+}
+
+}  // namespace pixel_convert
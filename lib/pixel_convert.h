@@ -0,0 +1,38 @@
+#ifndef LIB_PIXEL_CONVERT_H_
+#define LIB_PIXEL_CONVERT_H_
+
+#include <stdint.h>
+
+namespace pixel_convert {
+
+// Row converters between the channel orders of 8 bit pixels. |width| counts
+// pixels; |input| and |output| must not overlap. Each one runs the SSSE3,
+// AVX2 or NEON version the CPU supports, picked once at startup, or a scalar
+// loop; all of them give the same bytes.
+
+// BGRA to RGBA, and RGBA to BGRA.
+void SwapRedBlue(const uint8_t* input, int width, uint8_t* output);
+void BGRAToRGB(const uint8_t* input, int width, uint8_t* output);
+void RGBAToRGB(const uint8_t* input, int width, uint8_t* output);
+void BGRToRGB(const uint8_t* input, int width, uint8_t* output);
+// The alpha of the output is 0xFF.
+void RGBToBGRA(const uint8_t* input, int width, uint8_t* output);
+
+// Row scans for picking a smaller PNG color type. These write the green byte
+// of every BGRA, RGBA, BGR or RGB pixel, its gray level if its three color
+// bytes are equal, and return whether they are in all pixels.
+bool BGRAToGray(const uint8_t* input, int width, uint8_t* output);
+bool BGRToGray(const uint8_t* input, int width, uint8_t* output);
+// Whether the fourth byte of every four byte pixel is 0xFF.
+bool IsOpaque(const uint8_t* input, int width);
+
+// Names the converters in use: "avx2", "ssse3", "neon" or "scalar".
+const char* Implementation();
+
+// Switches to the named converters, for tests and benchmarks. Returns false
+// if this build or CPU lacks them. Not thread safe.
+bool SetImplementation(const char* name);
+
+}  // namespace pixel_convert
+
+#endif  // LIB_PIXEL_CONVERT_H_
@@ -0,0 +1,212 @@
+// Checks that every vector implementation of the pixel converters this build
+// and CPU support gives the same bytes and results as the scalar one.
+
+#include "lib/pixel_convert.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <random>
+#include <vector>
+
+namespace {
+
+// Covers the leftovers of the 16, 8, 5 and 4 pixel rounds, and the widths
+// at which a round needs one more pixel to follow.
+constexpr int kMaxWidth = 70;
+constexpr int kMaxOffset = 3;
+constexpr uint8_t kGuard = 0xa5;
+
+const char* const kImplementations[] = {"avx2", "ssse3", "neon"};
+
+struct RowConverterCase {
+  const char* name;
+  void (*convert)(const uint8_t* input, int width, uint8_t* output);
+  int input_bytes;
+  int output_bytes;
+};
+
+const RowConverterCase kRowConverters[] = {
+    {"SwapRedBlue", pixel_convert::SwapRedBlue, 4, 4},
+    {"BGRAToRGB", pixel_convert::BGRAToRGB, 4, 3},
+    {"RGBAToRGB", pixel_convert::RGBAToRGB, 4, 3},
+    {"BGRToRGB", pixel_convert::BGRToRGB, 3, 3},
+    {"RGBToBGRA", pixel_convert::RGBToBGRA, 3, 4},
+};
+
+struct GrayConverterCase {
+  const char* name;
+  bool (*convert)(const uint8_t* input, int width, uint8_t* output);
+  int input_bytes;
+};
+
+const GrayConverterCase kGrayConverters[] = {
+    {"BGRAToGray", pixel_convert::BGRAToGray, 4},
+    {"BGRToGray", pixel_convert::BGRToGray, 3},
+};
+
+// The result of one conversion: the output amid |kGuard| bytes, which must
+// stay as they are, and what the converter returned.
+struct Result {
+  std::vector<uint8_t> output;
+  bool returned = false;
+
+  bool operator==(const Result& other) const {
+    return output == other.output && returned == other.returned;
+  }
+};
+
+class PixelConvertTest {
+ public:
+  // Returns the number of failed cases.
+  int Run(const char* implementation);
+
+ private:
+  // Fills |input| with |width| pixels of |bytes| bytes after |offset| bytes,
+  // and nothing after them, so that ASan builds catch reads past the row.
+  // Gray pixels are opaque, and then one byte may be changed.
+  void MakeInput(int width,
+                 int bytes,
+                 int offset,
+                 bool gray,
+                 std::vector<uint8_t>* input);
+
+  // Runs |convert| on a fresh output of |output_size| bytes at |offset|.
+  template <typename Function>
+  Result Convert(const char* implementation,
+                 int output_size,
+                 int offset,
+                 Function convert);
+
+  bool Check(const char* implementation,
+             const char* name,
+             int width,
+             int input_offset,
+             int output_offset,
+             const Result& expected,
+             const Result& actual);
+
+  std::mt19937 random_{20240229};
+};
+
+int PixelConvertTest::Run(const char* implementation) {
+  int failures = 0;
+  std::vector<uint8_t> input;
+  for (int width = 0; width <= kMaxWidth; ++width) {
+    for (int input_offset = 0; input_offset <= kMaxOffset; ++input_offset) {
+      for (int output_offset = 0; output_offset <= kMaxOffset;
+           ++output_offset) {
+        for (const RowConverterCase& test : kRowConverters) {
+          MakeInput(width, test.input_bytes, input_offset, false, &input);
+          const uint8_t* in = input.data() + input_offset;
+          auto convert = [&](uint8_t* out) {
+            test.convert(in, width, out);
+            return false;
+          };
+          int size = width * test.output_bytes;
+          Result expected = Convert("scalar", size, output_offset, convert);
+          Result actual = Convert(implementation, size, output_offset, convert);
+          failures += !Check(implementation, test.name, width, input_offset,
+                             output_offset, expected, actual);
+        }
+        for (bool gray : {false, true}) {
+          for (const GrayConverterCase& test : kGrayConverters) {
+            MakeInput(width, test.input_bytes, input_offset, gray, &input);
+            const uint8_t* in = input.data() + input_offset;
+            auto convert = [&](uint8_t* out) {
+              return test.convert(in, width, out);
+            };
+            Result expected = Convert("scalar", width, output_offset, convert);
+            Result actual =
+                Convert(implementation, width, output_offset, convert);
+            failures += !Check(implementation, test.name, width, input_offset,
+                               output_offset, expected, actual);
+          }
+          MakeInput(width, 4, input_offset, gray, &input);
+          const uint8_t* in = input.data() + input_offset;
+          auto is_opaque = [&](uint8_t*) {
+            return pixel_convert::IsOpaque(in, width);
+          };
+          Result expected = Convert("scalar", 0, output_offset, is_opaque);
+          Result actual = Convert(implementation, 0, output_offset, is_opaque);
+          failures += !Check(implementation, "IsOpaque", width, input_offset,
+                             output_offset, expected, actual);
+        }
+      }
+    }
+  }
+  return failures;
+}
+
+void PixelConvertTest::MakeInput(int width,
+                                 int bytes,
+                                 int offset,
+                                 bool gray,
+                                 std::vector<uint8_t>* input) {
+  size_t size = static_cast<size_t>(width) * bytes;
+  // A new vector rather than assign(), whose capacity may be larger.
+  *input = std::vector<uint8_t>(offset + size);
+  uint8_t* pixels = input->data() + offset;
+  for (size_t i = 0; i < size; ++i)
+    pixels[i] = static_cast<uint8_t>(random_());
+  if (!gray)
+    return;
+
+  for (int x = 0; x < width; ++x) {
+    uint8_t* pixel = pixels + x * bytes;
+    pixel[1] = pixel[2] = pixel[0];
+    if (bytes == 4)
+      pixel[3] = 0xff;
+  }
+  if (width > 0 && random_() % 2) {
+    size_t byte = random_() % size;
+    pixels[byte] ^= static_cast<uint8_t>(1 + random_() % 255);
+  }
+}
+
+template <typename Function>
+Result PixelConvertTest::Convert(const char* implementation,
+                                 int output_size,
+                                 int offset,
+                                 Function convert) {
+  pixel_convert::SetImplementation(implementation);
+  Result result;
+  result.output.assign(output_size + 2 * kMaxOffset, kGuard);
+  result.returned = convert(result.output.data() + offset);
+  return result;
+}
+
+bool PixelConvertTest::Check(const char* implementation,
+                             const char* name,
+                             int width,
+                             int input_offset,
+                             int output_offset,
+                             const Result& expected,
+                             const Result& actual) {
+  if (actual == expected)
+    return true;
+  fprintf(stderr,
+          "%s %s differs from scalar at width %d, input offset %d, output "
+          "offset %d\n",
+          implementation, name, width, input_offset, output_offset);
+  return false;
+}
+
+}  // namespace
+
+int main() {
+  int failures = 0;
+  int tested = 0;
+  for (const char* implementation : kImplementations) {
+    if (!pixel_convert::SetImplementation(implementation))
+      continue;
+    PixelConvertTest test;
+    failures += test.Run(implementation);
+    ++tested;
+    printf("%s: checked against scalar\n", implementation);
+  }
+  if (!tested)
+    printf("No vector converters in this build or CPU, nothing to check\n");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,143 @@
+#include "src/bitmap_pool.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <utility>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+constexpr size_t kRowAlignment = 64;
+constexpr size_t kHugePageSize = 2 << 20;
+
+size_t AlignUp(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+}  // namespace
+
+BitmapPool::BitmapPool(size_t max_free) : max_free_(max_free) {}
+
+BitmapPool::~BitmapPool() {
+  // Bitmaps that were never released are leaked rather than left dangling.
+  for (const Buffer& buffer : free_)
+    Free(buffer);
+}
+
+ScopedFPDFBitmap BitmapPool::Acquire(int width, int height, int format) {
+  if (format != FPDFBitmap_BGR && format != FPDFBitmap_BGRx &&
+      format != FPDFBitmap_BGRA) {
+    return nullptr;
+  }
+  int bytes_per_pixel = format == FPDFBitmap_BGR ? 3 : 4;
+  if (width <= 0 || height <= 0 || width > INT32_MAX / bytes_per_pixel)
+    return nullptr;
+  size_t stride =
+      AlignUp(static_cast<size_t>(width) * bytes_per_pixel, kRowAlignment);
+  if (stride > INT32_MAX || static_cast<size_t>(height) > SIZE_MAX / stride)
+    return nullptr;
+  size_t size = stride * height;
+
+  // Take the smallest free buffer that fits, unless it is more than twice as
+  // large as needed; pages of one document mostly share a size anyway.
+  auto best = free_.end();
+  for (auto it = free_.begin(); it != free_.end(); ++it) {
+    if (it->size >= size && it->size / 2 <= size &&
+        (best == free_.end() || it->size < best->size)) {
+      best = it;
+    }
+  }
+  Buffer buffer;
+  if (best != free_.end()) {
+    buffer = *best;
+    free_.erase(best);
+  } else {
+    buffer = Allocate(size);
+    if (!buffer.data)
+      return nullptr;
+  }
+
+  ScopedFPDFBitmap bitmap(FPDFBitmap_CreateEx(width, height, format,
+                                              buffer.data,
+                                              static_cast<int>(stride)));
+  if (!bitmap) {
+    free_.push_back(buffer);
+    return nullptr;
+  }
+  in_use_[buffer.data] = buffer;
+  return bitmap;
+}
+
+void BitmapPool::Release(ScopedFPDFBitmap bitmap) {
+  if (!bitmap)
+    return;
+  auto it = in_use_.find(FPDFBitmap_GetBuffer(bitmap.get()));
+  bitmap.reset();
+  if (it == in_use_.end())
+    return;
+
+  Buffer buffer = it->second;
+  in_use_.erase(it);
+  if (free_.size() >= max_free_) {
+    // Drop the oldest buffer, it is the least likely to match again.
+    Free(free_.front());
+    free_.erase(free_.begin());
+  }
+  free_.push_back(buffer);
+}
+
+// static
+BitmapPool::Buffer BitmapPool::Allocate(size_t size) {
+  Buffer buffer;
+#ifdef _WIN32
+  buffer.data = _aligned_malloc(size, kRowAlignment);
+  buffer.size = size;
+#else
+#ifdef MADV_HUGEPAGE
+  if (size >= kHugePageSize) {
+    // Over-allocate so that the buffer can start on a huge page boundary,
+    // then give the unused head and tail back.
+    size_t mapped_size = AlignUp(size, kHugePageSize);
+    size_t reserve = mapped_size + kHugePageSize;
+    void* mapping = mmap(nullptr, reserve, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping != MAP_FAILED) {
+      uintptr_t start = reinterpret_cast<uintptr_t>(mapping);
+      uintptr_t aligned = AlignUp(start, kHugePageSize);
+      if (aligned > start)
+        munmap(mapping, aligned - start);
+      size_t tail = start + reserve - (aligned + mapped_size);
+      if (tail)
+        munmap(reinterpret_cast<void*>(aligned + mapped_size), tail);
+      buffer.data = reinterpret_cast<void*>(aligned);
+      buffer.size = mapped_size;
+      buffer.mapped = true;
+      (void)madvise(buffer.data, mapped_size, MADV_HUGEPAGE);
+      return buffer;
+    }
+  }
+#endif  // MADV_HUGEPAGE
+  if (posix_memalign(&buffer.data, kRowAlignment, size) != 0)
+    buffer.data = nullptr;
+  buffer.size = size;
+#endif  // _WIN32
+  return buffer;
+}
+
+// static
+void BitmapPool::Free(const Buffer& buffer) {
+#ifdef _WIN32
+  _aligned_free(buffer.data);
+#else
+  if (buffer.mapped)
+    munmap(buffer.data, buffer.size);
+  else
+    free(buffer.data);
+#endif
+}
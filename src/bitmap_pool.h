@@ -0,0 +1,48 @@
+#ifndef SRC_BITMAP_POOL_H_
+#define SRC_BITMAP_POOL_H_
+
+#include <stddef.h>
+
+#include <map>
+#include <vector>
+
+#include "pdfium/include/cpp/fpdf_scopers.h"
+
+// Hands out bitmaps whose pixels live in buffers owned by the pool, so that
+// consecutive pages reuse the same memory instead of allocating, faulting in
+// and zeroing a fresh buffer every time. Rows are 64 byte aligned; buffers of
+// 2 MiB and more are backed by transparent huge pages where available.
+// Not thread safe, and like any PDFium object only used on the PDFium thread.
+class BitmapPool {
+ public:
+  // Keeps up to |max_free| unused buffers around for later pages.
+  explicit BitmapPool(size_t max_free);
+  ~BitmapPool();
+
+  BitmapPool(const BitmapPool&) = delete;
+  BitmapPool& operator=(const BitmapPool&) = delete;
+
+  // Returns a bitmap like FPDFBitmap_CreateEx() of |format|, FPDFBitmap_BGR,
+  // FPDFBitmap_BGRx or FPDFBitmap_BGRA, with undefined content. It must be
+  // given back with Release(), and the pool must outlive it.
+  ScopedFPDFBitmap Acquire(int width, int height, int format);
+
+  // Destroys |bitmap| and keeps its buffer for the next Acquire().
+  void Release(ScopedFPDFBitmap bitmap);
+
+ private:
+  struct Buffer {
+    void* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+  };
+
+  static Buffer Allocate(size_t size);
+  static void Free(const Buffer& buffer);
+
+  const size_t max_free_;
+  std::vector<Buffer> free_;
+  std::map<void*, Buffer> in_use_;
+};
+
+#endif  // SRC_BITMAP_POOL_H_
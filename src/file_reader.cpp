@@ -0,0 +1,159 @@
+#include "src/file_reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+namespace {
+
+constexpr size_t kBlockSize = 64 << 10;
+constexpr size_t kMaxReadaheadBlocks = 16;
+
+}  // namespace
+
+// static
+std::unique_ptr<FileReader> FileReader::Open(const char* filename,
+                                             size_t cache_bytes) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open: %s\n", filename);
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || !st.st_size) {
+    fprintf(stderr, "Not a readable regular file: %s\n", filename);
+    close(fd);
+    return nullptr;
+  }
+  uint64_t length = static_cast<uint64_t>(st.st_size);
+  if (length > std::numeric_limits<unsigned long>::max()) {
+    fprintf(stderr, "File too large for this platform: %s\n", filename);
+    close(fd);
+    return nullptr;
+  }
+#ifdef POSIX_FADV_RANDOM
+  // The readahead below knows better which reads are sequential.
+  (void)posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+  size_t max_blocks = std::max(cache_bytes / kBlockSize, kMaxReadaheadBlocks);
+  return std::unique_ptr<FileReader>(new FileReader(fd, length, max_blocks));
+}
+
+FileReader::FileReader(int fd, uint64_t length, size_t max_blocks)
+    : fd_(fd), length_(length), max_blocks_(max_blocks) {
+  file_access_.m_FileLen = static_cast<unsigned long>(length);
+  file_access_.m_GetBlock = GetBlock;
+  file_access_.m_Param = this;
+}
+
+FileReader::~FileReader() {
+  close(fd_);
+}
+
+// static
+int FileReader::GetBlock(void* param,
+                         unsigned long pos,
+                         unsigned char* buf,
+                         unsigned long size) {
+  return static_cast<FileReader*>(param)->Read(pos, buf, size);
+}
+
+bool FileReader::Read(uint64_t pos, unsigned char* buf, size_t size) {
+  if (pos > length_ || size > length_ - pos)
+    return false;
+
+  if (pos == next_pos_)
+    readahead_blocks_ = std::min(readahead_blocks_ * 2, kMaxReadaheadBlocks);
+  else
+    readahead_blocks_ = 1;
+  next_pos_ = pos + size;
+
+  // Large reads, typically whole content or image streams, would only push
+  // everything else out of the cache.
+  if (size >= kMaxReadaheadBlocks * kBlockSize)
+    return ReadAt(pos, reinterpret_cast<char*>(buf), size);
+
+  while (size) {
+    const Block* block = GetCachedBlock(pos / kBlockSize);
+    size_t offset = pos % kBlockSize;
+    if (!block || offset >= block->size)
+      return false;
+    size_t n = std::min(size, block->size - offset);
+    memcpy(buf, block->data.get() + offset, n);
+    buf += n;
+    pos += n;
+    size -= n;
+  }
+  return true;
+}
+
+const FileReader::Block* FileReader::GetCachedBlock(uint64_t index) {
+  auto it = blocks_.find(index);
+  if (it == blocks_.end()) {
+    if (!LoadBlocks(index, readahead_blocks_))
+      return nullptr;
+    it = blocks_.find(index);
+  }
+  lru_.splice(lru_.begin(), lru_, it->second.lru);
+  return &it->second;
+}
+
+bool FileReader::LoadBlocks(uint64_t first, size_t count) {
+  uint64_t blocks_in_file = (length_ + kBlockSize - 1) / kBlockSize;
+  count = static_cast<size_t>(std::min<uint64_t>(count, blocks_in_file - first));
+  // Stop at the first block that is cached already.
+  for (size_t i = 1; i < count; ++i) {
+    if (blocks_.count(first + i)) {
+      count = i;
+      break;
+    }
+  }
+
+  uint64_t pos = first * kBlockSize;
+  size_t size =
+      static_cast<size_t>(std::min<uint64_t>(count * kBlockSize, length_ - pos));
+  std::vector<char> data(size);
+  if (!ReadAt(pos, data.data(), size))
+    return false;
+
+  for (size_t i = 0; i < count; ++i) {
+    while (blocks_.size() >= max_blocks_) {
+      blocks_.erase(lru_.back());
+      lru_.pop_back();
+    }
+    Block& block = blocks_[first + i];
+    block.size = std::min(kBlockSize, size - i * kBlockSize);
+    block.data.reset(new char[block.size]);
+    memcpy(block.data.get(), data.data() + i * kBlockSize, block.size);
+    // Readahead blocks go in behind the one that was asked for.
+    block.lru = lru_.insert(i ? std::next(lru_.begin()) : lru_.begin(),
+                            first + i);
+  }
+  return true;
+}
+
+bool FileReader::ReadAt(uint64_t pos, char* buf, size_t size) {
+  while (size) {
+    ssize_t n = pread(fd_, buf, size, static_cast<off_t>(pos));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      fprintf(stderr, "Failed to read at offset %llu: %s\n",
+              static_cast<unsigned long long>(pos),
+              n < 0 ? strerror(errno) : "unexpected end of file");
+      return false;
+    }
+    bytes_read_ += n;
+    buf += n;
+    pos += n;
+    size -= n;
+  }
+  return true;
+}
@@ -0,0 +1,63 @@
+#ifndef SRC_FILE_READER_H_
+#define SRC_FILE_READER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#include "pdfium/include/fpdfview.h"
+
+// Serves PDFium's reads with pread() instead of loading the whole file, so a
+// document is only read as far as rendering actually needs it. Reads go
+// through an LRU cache of fixed size blocks. Sequential reads grow the
+// readahead window up to a limit; a seek shrinks it back to a single block.
+class FileReader {
+ public:
+  // Opens |filename| with a cache of up to |cache_bytes|. Returns nullptr and
+  // prints the reason if it can't be opened.
+  static std::unique_ptr<FileReader> Open(const char* filename,
+                                          size_t cache_bytes);
+  ~FileReader();
+
+  FileReader(const FileReader&) = delete;
+  FileReader& operator=(const FileReader&) = delete;
+
+  FPDF_FILEACCESS* file_access() { return &file_access_; }
+  uint64_t length() const { return length_; }
+  uint64_t bytes_read() const { return bytes_read_; }
+
+ private:
+  struct Block {
+    std::unique_ptr<char[]> data;
+    size_t size = 0;
+    std::list<uint64_t>::iterator lru;
+  };
+
+  FileReader(int fd, uint64_t length, size_t max_blocks);
+
+  static int GetBlock(void* param,
+                      unsigned long pos,
+                      unsigned char* buf,
+                      unsigned long size);
+
+  bool Read(uint64_t pos, unsigned char* buf, size_t size);
+  const Block* GetCachedBlock(uint64_t index);
+  bool LoadBlocks(uint64_t first, size_t count);
+  bool ReadAt(uint64_t pos, char* buf, size_t size);
+
+  const int fd_;
+  const uint64_t length_;
+  const size_t max_blocks_;
+  FPDF_FILEACCESS file_access_ = {};
+
+  std::unordered_map<uint64_t, Block> blocks_;
+  std::list<uint64_t> lru_;
+  uint64_t next_pos_ = 0;
+  size_t readahead_blocks_ = 1;
+  uint64_t bytes_read_ = 0;
+};
+
+#endif  // SRC_FILE_READER_H_
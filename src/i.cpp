@@ -1,5 +1,13 @@
 #include "src/i.h"
 
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 TestLoader::TestLoader(pdfium::span<const char> span) : m_Span(span) {}
 
 // static
@@ -17,30 +25,100 @@ int TestLoader::GetBlock(void* param,
   return 1;
 }
 
-std::unique_ptr<char, pdfium::FreeDeleter> GetFileContents(const char* filename,
-                                                           size_t* retlen) {
-  FILE* file = fopen(filename, "rb");
-  if (!file) {
-    fprintf(stderr, "Failed to open: %s\n", filename);
+namespace {
+
+// Inputs up to this size are read ahead completely once mapped; for larger
+// ones only the tail holding the cross reference table and trailer is.
+constexpr size_t kWillNeedWholeFileLimit = 64 << 20;
+constexpr size_t kWillNeedTailSize = 1 << 20;
+
+FileContents ReadFileContents(FILE* file, const char* filename,
+                              size_t* retlen) {
+  size_t capacity = 1 << 16;
+  size_t length = 0;
+  std::unique_ptr<char, pdfium::FreeDeleter> buffer(
+      static_cast<char*>(malloc(capacity)));
+  while (buffer) {
+    length += fread(buffer.get() + length, 1, capacity - length, file);
+    if (length < capacity)
+      break;
+    capacity *= 2;
+    char* grown = static_cast<char*>(realloc(buffer.get(), capacity));
+    if (!grown)
+      return nullptr;
+    (void)buffer.release();
+    buffer.reset(grown);
+  }
+  if (!buffer)
+    return nullptr;
+  if (ferror(file)) {
+    fprintf(stderr, "Failed to read: %s\n", filename);
     return nullptr;
   }
-  (void)fseek(file, 0, SEEK_END);
-  size_t file_length = ftell(file);
-  if (!file_length) {
+  if (!length)
+    return nullptr;
+  *retlen = length;
+  return FileContents(buffer.release());
+}
+
+#ifndef _WIN32
+FileContents MapFileContents(FILE* file, size_t* retlen) {
+  struct stat st;
+  if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) || !st.st_size ||
+      static_cast<uint64_t>(st.st_size) > SIZE_MAX) {
     return nullptr;
   }
-  (void)fseek(file, 0, SEEK_SET);
-  std::unique_ptr<char, pdfium::FreeDeleter> buffer(
-      static_cast<char*>(malloc(file_length)));
-  if (!buffer) {
+
+  size_t length = static_cast<size_t>(st.st_size);
+  void* mapped =
+      mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+  if (mapped == MAP_FAILED)
     return nullptr;
+
+  char* data = static_cast<char*>(mapped);
+  if (length <= kWillNeedWholeFileLimit) {
+    madvise(data, length, MADV_WILLNEED);
+  } else {
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t tail = (length - kWillNeedTailSize) & ~(page_size - 1);
+    madvise(data + tail, length - tail, MADV_WILLNEED);
   }
-  size_t bytes_read = fread(buffer.get(), 1, file_length, file);
-  (void)fclose(file);
-  if (bytes_read != file_length) {
-    fprintf(stderr, "Failed to read: %s\n", filename);
+  *retlen = length;
+  pdfium::FileContentsDeleter deleter;
+  deleter.mapped_length = length;
+  return FileContents(data, deleter);
+}
+#endif  // _WIN32
+
+}  // namespace
+
+void pdfium::FileContentsDeleter::operator()(void* ptr) const {
+#ifndef _WIN32
+  if (mapped_length) {
+    munmap(ptr, mapped_length);
+    return;
+  }
+#endif  // _WIN32
+  free(ptr);
+}
+
+FileContents GetFileContents(const char* filename,
+                             size_t* retlen,
+                             bool use_mmap) {
+  bool is_stdin = strcmp(filename, "-") == 0;
+  FILE* file = is_stdin ? stdin : fopen(filename, "rb");
+  if (!file) {
+    fprintf(stderr, "Failed to open: %s\n", filename);
     return nullptr;
   }
-  *retlen = bytes_read;
-  return buffer;
-}
\ No newline at end of file
+  FileContents contents;
+#ifndef _WIN32
+  if (use_mmap)
+    contents = MapFileContents(file, retlen);
+#endif  // _WIN32
+  if (!contents)
+    contents = ReadFileContents(file, filename, retlen);
+  if (!is_stdin)
+    (void)fclose(file);
+  return contents;
+}
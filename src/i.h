@@ -13,10 +13,24 @@ namespace pdfium
     inline void operator()(void *ptr) const { free(ptr); }
   };
 
+  // Releases what GetFileContents() returned: unmaps it when it was mapped,
+  // free()s it otherwise.
+  struct FileContentsDeleter
+  {
+    size_t mapped_length = 0;
+    void operator()(void *ptr) const;
+  };
+
 }
 
-std::unique_ptr<char, pdfium::FreeDeleter> GetFileContents(const char *filename,
-                                                           size_t *retlen);
+using FileContents = std::unique_ptr<char, pdfium::FileContentsDeleter>;
+
+// Maps |filename| into memory when |use_mmap| is set and it is a regular file,
+// so that PDFium reads straight from the page cache. Pipes and anything else
+// that can't be mapped are read into a heap buffer instead. "-" reads stdin.
+FileContents GetFileContents(const char *filename,
+                             size_t *retlen,
+                             bool use_mmap);
 
 class TestLoader
 {
@@ -2,16 +2,23 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <chrono>
+#include <fstream>
 #include <functional>
+#include <iostream>
 #include <iterator>
+#include <limits>
 #include <map>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <algorithm>
@@ -36,14 +43,31 @@
 // #include "testing/utils/path_service.h"
 // #include "third_party/abseil-cpp/absl/types/optional.h"
 
+#include "lib/image_resize.h"
+#include "lib/pixel_convert.h"
+#include "src/bitmap_pool.h"
 #include "src/i.h"
+#include "src/page_cache.h"
+#include "src/render_pipeline.h"
+#include "src/tile_pyramid.h"
+#ifndef _WIN32
+#include "src/file_reader.h"
+#include "src/stream_loader.h"
+#include "src/worker_pool.h"
+#endif
 
 #ifdef _WIN32
 #include <io.h>
 #else
+#include <errno.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #endif
 
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
 #ifdef ENABLE_CALLGRIND
 #include <valgrind/callgrind.h>
 #endif // ENABLE_CALLGRIND
@@ -68,6 +92,7 @@ enum class OutputFormat
 {
   kNone,
   kPng,
+  kDzi,
 };
 
 namespace
@@ -79,6 +104,12 @@ namespace
 
     bool show_config = false;
     bool use_load_mem_document = false;
+    bool no_mmap = false;
+    // Read the input on demand with pread() through a cache of this many MiB.
+    bool use_pread = false;
+    int pread_cache_mb = 16;
+    // Pages kept loaded for the form callbacks, 0 keeps all of them.
+    int page_cache_size = 16;
     bool render_oneshot = false;
     bool lcd_text = false;
     bool no_nativetext = false;
@@ -115,6 +146,85 @@ namespace
     std::string height_as_string;
     bool maintain_aspect_ratio = false;
     bool allow_enlargement = false;
+
+    // Job manifest for batch mode, "-" reads it from stdin.
+    std::string batch_manifest;
+    // Batch mode runs its jobs in this many pre-forked workers when set.
+    int workers = 0;
+    int worker_max_jobs = 0;
+    int worker_max_rss_mb = 0;
+    // Otherwise up to this many batch jobs take turns rendering on one thread
+    // when set, each job for |weight| time slices per turn.
+    int interleave = 0;
+    int weight = 1;
+    // Pages of one document are split across this many forked processes.
+    int jobs = 1;
+    // PNG encoding runs on this many background threads when set.
+    int encode_threads = 0;
+    // Each PNG is deflated in this many row bands in parallel.
+    int png_threads = 1;
+    // PNGs are written as RGB or RGBA even when a gray or indexed image with
+    // fewer bits per pixel would hold them exactly.
+    bool png_full_color = false;
+    // zlib level, strategy and the kFilter* row filters of the PNGs; the
+    // defaults leave them to the encoder. --png-preset sets all three.
+    int png_level = -1;
+    image_diff_png::DeflateStrategy png_strategy =
+        image_diff_png::DeflateStrategy::kAuto;
+    int png_filters = 0;
+    image_diff_png::PngEncoder png_encoder =
+        image_diff_png::PngEncoder::kLibpng;
+    // Rendering gives up on a page or the remaining pages once this many
+    // seconds have passed.
+    double page_timeout = 0;
+    double doc_timeout = 0;
+    // Pages that timed out are written as far as they were rendered.
+    bool partial_output = false;
+    // Pages whose bitmap would exceed these are rendered at a smaller scale;
+    // 0 means no limit.
+    int64_t max_pixels = 0;
+    int64_t max_memory_mb = 0;
+    // PNG pages are rendered and written in bands of this many rows when set.
+    int band_height = 0;
+    // Only this region of each page is rendered when set: x, y, width and
+    // height in output pixels, or in points from the top left corner.
+    bool crop = false;
+    bool crop_in_points = false;
+    double crop_rect[4] = {};
+    // Edge length of the tiles of --dzi pyramids.
+    int tile_size = 256;
+    // Each PNG page is written once per size, with its longer edge that many
+    // pixels long, largest first. Only the largest one is rendered.
+    std::vector<int> sizes;
+    // Interactive form fields are not drawn.
+    bool no_forms = false;
+    // PNG pages are scaled down from their embedded thumbnail instead of
+    // rendered when it is at least as large as the page image.
+    bool use_thumbnails = false;
+    // The --variant arguments, "<name>:<options>".
+    std::vector<std::string> variants;
+  };
+
+  // One set of render and output options pages are written with, see
+  // --variant. All variants of a page render the same loaded page.
+  struct RenderVariant
+  {
+    std::string name;
+    Options options;
+    // The output name with |name| added.
+    std::string out_name;
+  };
+
+  bool SplitManifestLine(const std::string &line,
+                         std::vector<std::string> *args);
+  bool ParseVariants(const Options &options,
+                     std::vector<RenderVariant> *variants);
+
+  struct ProcessResult
+  {
+    bool loaded = false;
+    int processed_pages = 0;
+    int bad_pages = 0;
   };
 
   int PageRenderFlagsFromOptions(const Options &options)
@@ -145,11 +255,25 @@ namespace
     return flags;
   }
 
+  image_diff_png::EncodeOptions EncodeOptionsFromOptions(const Options &options)
+  {
+    image_diff_png::EncodeOptions encode_options;
+    encode_options.threads = options.png_threads;
+    // Pages rendered with FPDF_REVERSE_BYTE_ORDER are in PNG byte order.
+    encode_options.rgb_order = options.reverse_byte_order;
+    encode_options.reduce_colors = !options.png_full_color;
+    encode_options.compression_level = options.png_level;
+    encode_options.strategy = options.png_strategy;
+    encode_options.filters = options.png_filters;
+    encode_options.encoder = options.png_encoder;
+    return encode_options;
+  }
+
   struct FPDF_FORMFILLINFO_PDFiumTest final : public FPDF_FORMFILLINFO
   {
-    // Hold a map of the currently loaded pages in order to avoid them
-    // to get loaded twice.
-    std::map<int, ScopedFPDFPage> loaded_pages;
+    // Holds the recently loaded pages in order to avoid them to get loaded
+    // twice.
+    PageCache *page_cache = nullptr;
 
     // Hold a pointer of FPDF_FORMHANDLE so that PDFium app hooks can
     // make use of it.
@@ -253,6 +377,124 @@ namespace
       {
         options->use_load_mem_document = true;
       }
+      else if (cur_arg == "--no-mmap")
+      {
+        options->no_mmap = true;
+      }
+      else if (cur_arg == "--pread")
+      {
+        options->use_pread = true;
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--pread-cache=", &value))
+      {
+        std::stringstream(value) >> options->pread_cache_mb;
+        if (options->pread_cache_mb < 0)
+        {
+          fprintf(stderr, "Invalid --pread-cache argument, must be non-negative\n");
+          return false;
+        }
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--page-timeout=", &value))
+      {
+        std::stringstream(value) >> options->page_timeout;
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--doc-timeout=", &value))
+      {
+        std::stringstream(value) >> options->doc_timeout;
+      }
+      else if (cur_arg == "--partial-output")
+      {
+        options->partial_output = true;
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--max-pixels=", &value))
+      {
+        std::stringstream(value) >> options->max_pixels;
+        if (options->max_pixels < 1)
+        {
+          fprintf(stderr, "Invalid --max-pixels argument, must be positive\n");
+          return false;
+        }
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--crop=", &value))
+      {
+        char unit[3] = {};
+        double *rect = options->crop_rect;
+        int fields = sscanf(value.c_str(), "%lf,%lf,%lf,%lf%2s", &rect[0],
+                            &rect[1], &rect[2], &rect[3], unit);
+        options->crop_in_points = fields == 5 && strcmp(unit, "pt") == 0;
+        if ((fields != 4 && !options->crop_in_points) || rect[2] <= 0 ||
+            rect[3] <= 0)
+        {
+          fprintf(stderr, "Invalid --crop argument, must be x,y,w,h[pt]\n");
+          return false;
+        }
+        options->crop = true;
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--sizes=", &value))
+      {
+        options->sizes.clear();
+        std::stringstream stream(value);
+        std::string size_string;
+        while (std::getline(stream, size_string, ','))
+        {
+          int size = 0;
+          std::stringstream(size_string) >> size;
+          if (size < 1)
+          {
+            fprintf(stderr, "Invalid --sizes argument, must be positive numbers\n");
+            return false;
+          }
+          options->sizes.push_back(size);
+        }
+        if (options->sizes.empty())
+        {
+          fprintf(stderr, "Invalid --sizes argument, must be positive numbers\n");
+          return false;
+        }
+        std::sort(options->sizes.rbegin(), options->sizes.rend());
+        options->sizes.erase(
+            std::unique(options->sizes.begin(), options->sizes.end()),
+            options->sizes.end());
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--variant=", &value))
+      {
+        options->variants.push_back(value);
+      }
+      else if (cur_arg == "--no-forms")
+      {
+        options->no_forms = true;
+      }
+      else if (cur_arg == "--use-thumbs")
+      {
+        options->use_thumbnails = true;
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--band-height=", &value))
+      {
+        std::stringstream(value) >> options->band_height;
+        if (options->band_height < 1)
+        {
+          fprintf(stderr, "Invalid --band-height argument, must be positive\n");
+          return false;
+        }
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--max-memory=", &value))
+      {
+        std::stringstream(value) >> options->max_memory_mb;
+        if (options->max_memory_mb < 1)
+        {
+          fprintf(stderr, "Invalid --max-memory argument, must be positive\n");
+          return false;
+        }
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--page-cache=", &value))
+      {
+        std::stringstream(value) >> options->page_cache_size;
+        if (options->page_cache_size < 0)
+        {
+          fprintf(stderr, "Invalid --page-cache argument, must be non-negative\n");
+          return false;
+        }
+      }
       else if (cur_arg == "--render-oneshot")
       {
         options->render_oneshot = true;
@@ -358,6 +600,19 @@ namespace
         }
         options->output_format = OutputFormat::kPng;
       }
+      else if (cur_arg == "--dzi")
+      {
+        options->output_format = OutputFormat::kDzi;
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--tile-size=", &value))
+      {
+        std::stringstream(value) >> options->tile_size;
+        if (options->tile_size < 2 || options->tile_size % 2)
+        {
+          fprintf(stderr, "Invalid --tile-size argument, must be even\n");
+          return false;
+        }
+      }
       else if (cur_arg == "--maintain-aspect-ratio")
       {
         options->maintain_aspect_ratio = true;
@@ -440,6 +695,172 @@ namespace
         }
         options->height_as_string = value;
       }
+      else if (ParseSwitchKeyValue(cur_arg, "--batch=", &value))
+      {
+        if (!options->batch_manifest.empty())
+        {
+          fprintf(stderr, "Duplicate --batch argument\n");
+          return false;
+        }
+        options->batch_manifest = value;
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--workers=", &value))
+      {
+        std::stringstream(value) >> options->workers;
+        if (options->workers < 1)
+        {
+          fprintf(stderr, "Invalid --workers argument, must be positive\n");
+          return false;
+        }
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--interleave=", &value))
+      {
+        std::stringstream(value) >> options->interleave;
+        if (options->interleave < 1)
+        {
+          fprintf(stderr, "Invalid --interleave argument, must be positive\n");
+          return false;
+        }
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--weight=", &value))
+      {
+        std::stringstream(value) >> options->weight;
+        if (options->weight < 1)
+        {
+          fprintf(stderr, "Invalid --weight argument, must be positive\n");
+          return false;
+        }
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--jobs=", &value))
+      {
+        std::stringstream(value) >> options->jobs;
+        if (options->jobs < 1)
+        {
+          fprintf(stderr, "Invalid --jobs argument, must be positive\n");
+          return false;
+        }
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--encode-threads=", &value))
+      {
+        std::stringstream(value) >> options->encode_threads;
+        if (options->encode_threads < 0)
+        {
+          fprintf(stderr, "Invalid --encode-threads argument, must be non-negative\n");
+          return false;
+        }
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--png-threads=", &value))
+      {
+        std::stringstream(value) >> options->png_threads;
+        if (options->png_threads < 1)
+        {
+          fprintf(stderr, "Invalid --png-threads argument, must be positive\n");
+          return false;
+        }
+      }
+      else if (cur_arg == "--png-full-color")
+      {
+        options->png_full_color = true;
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--png-encoder=", &value))
+      {
+        if (value == "libpng")
+          options->png_encoder = image_diff_png::PngEncoder::kLibpng;
+        else if (value == "fast")
+          options->png_encoder = image_diff_png::PngEncoder::kFast;
+        else
+        {
+          fprintf(stderr, "Invalid --png-encoder argument, must be libpng or fast\n");
+          return false;
+        }
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--png-preset=", &value))
+      {
+        image_diff_png::EncodeOptions preset;
+        if (!image_diff_png::ApplyEncodePreset(value, &preset))
+        {
+          fprintf(stderr, "Invalid --png-preset argument, must be fast, balanced or small\n");
+          return false;
+        }
+        options->png_level = preset.compression_level;
+        options->png_strategy = preset.strategy;
+        options->png_filters = preset.filters;
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--png-level=", &value))
+      {
+        options->png_level = -2;
+        std::stringstream(value) >> options->png_level;
+        if (options->png_level < -1 || options->png_level > 9)
+        {
+          fprintf(stderr, "Invalid --png-level argument, must be -1 to 9\n");
+          return false;
+        }
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--png-strategy=", &value))
+      {
+        using image_diff_png::DeflateStrategy;
+        if (value == "default")
+          options->png_strategy = DeflateStrategy::kDefault;
+        else if (value == "filtered")
+          options->png_strategy = DeflateStrategy::kFiltered;
+        else if (value == "rle")
+          options->png_strategy = DeflateStrategy::kRle;
+        else if (value == "huffman")
+          options->png_strategy = DeflateStrategy::kHuffmanOnly;
+        else
+        {
+          fprintf(stderr, "Invalid --png-strategy argument, must be default, filtered, rle or huffman\n");
+          return false;
+        }
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--png-filters=", &value))
+      {
+        static const char *const kFilterNames[] = {"none", "sub", "up",
+                                                   "average", "paeth"};
+        options->png_filters = 0;
+        std::stringstream stream(value);
+        std::string name;
+        while (std::getline(stream, name, ','))
+        {
+          int filter = 0;
+          if (name == "all")
+            filter = image_diff_png::kAllFilters;
+          for (int type = 0; type < 5; ++type)
+          {
+            if (name == kFilterNames[type])
+              filter = 1 << type;
+          }
+          if (!filter)
+          {
+            options->png_filters = 0;
+            break;
+          }
+          options->png_filters |= filter;
+        }
+        if (!options->png_filters)
+        {
+          fprintf(stderr, "Invalid --png-filters argument, must be all or a list of none, sub, up, average and paeth\n");
+          return false;
+        }
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--worker-max-jobs=", &value))
+      {
+        std::stringstream(value) >> options->worker_max_jobs;
+        if (options->worker_max_jobs < 0)
+        {
+          fprintf(stderr, "Invalid --worker-max-jobs argument, must be non-negative\n");
+          return false;
+        }
+      }
+      else if (ParseSwitchKeyValue(cur_arg, "--worker-max-rss=", &value))
+      {
+        std::stringstream(value) >> options->worker_max_rss_mb;
+        if (options->worker_max_rss_mb < 0)
+        {
+          fprintf(stderr, "Invalid --worker-max-rss argument, must be non-negative\n");
+          return false;
+        }
+      }
       else if (cur_arg.size() >= 2 && cur_arg[0] == '-' && cur_arg[1] == '-')
       {
         fprintf(stderr, "Unrecognized argument %s\n", cur_arg.c_str());
@@ -450,12 +871,88 @@ namespace
         break;
       }
     }
+    // Banded pages are never whole in memory to be scaled down.
+    if (!options->sizes.empty() &&
+        (options->band_height > 0 || options->crop ||
+         options->output_format == OutputFormat::kDzi))
+    {
+      fprintf(stderr, "--sizes cannot be combined with --band-height, --crop or --dzi\n");
+      return false;
+    }
+    std::vector<RenderVariant> variants;
+    if (!ParseVariants(*options, &variants))
+      return false;
     for (size_t i = cur_idx; i < args.size(); i++)
       files->push_back(args[i]);
 
     return true;
   }
 
+  // Parses the --variant arguments of |options|. The options of each variant
+  // are quoted like a batch job line and apply on top of |options|.
+  bool ParseVariants(const Options &options,
+                     std::vector<RenderVariant> *variants)
+  {
+    for (const std::string &spec : options.variants)
+    {
+      size_t colon = spec.find(':');
+      RenderVariant variant;
+      variant.name = spec.substr(0, colon);
+      variant.options = options;
+      variant.options.variants.clear();
+      bool valid = !variant.name.empty() &&
+                   variant.name.find_first_of("/\\") == std::string::npos;
+      for (const RenderVariant &other : *variants)
+        valid = valid && other.name != variant.name;
+      if (valid && colon != std::string::npos)
+      {
+        // Options the variant gives again replace those of the command line
+        // instead of being duplicates.
+        Options &variant_options = variant.options;
+        variant_options.scale_factor_as_string.clear();
+        variant_options.width_as_string.clear();
+        variant_options.height_as_string.clear();
+        variant_options.password.clear();
+        variant_options.pages = false;
+        variant_options.time = -1;
+        variant_options.batch_manifest.clear();
+        std::vector<std::string> args(1, "pdf-renderer");
+        std::vector<std::string> files;
+        valid = SplitManifestLine(spec.substr(colon + 1), &args) &&
+                ParseCommandLine(args, &variant_options, &files) &&
+                files.empty() && variant_options.variants.empty();
+        // The document is loaded, and its pages picked, once for all
+        // variants.
+        if (valid && (!variant_options.password.empty() ||
+                      variant_options.pages || variant_options.time > -1 ||
+                      !variant_options.batch_manifest.empty()))
+        {
+          fprintf(stderr, "--variant cannot change --password, --pages, --time or --batch\n");
+          valid = false;
+        }
+        if (variant_options.scale_factor_as_string.empty())
+          variant_options.scale_factor_as_string = options.scale_factor_as_string;
+        if (variant_options.width_as_string.empty())
+          variant_options.width_as_string = options.width_as_string;
+        if (variant_options.height_as_string.empty())
+          variant_options.height_as_string = options.height_as_string;
+        variant_options.password = options.password;
+        variant_options.pages = options.pages;
+        variant_options.first_page = options.first_page;
+        variant_options.last_page = options.last_page;
+        variant_options.time = options.time;
+        variant_options.batch_manifest = options.batch_manifest;
+      }
+      if (!valid)
+      {
+        fprintf(stderr, "Invalid --variant argument %s\n", spec.c_str());
+        return false;
+      }
+      variants->push_back(std::move(variant));
+    }
+    return true;
+  }
+
   void PrintLastError()
   {
     unsigned long err = FPDF_GetLastError();
@@ -496,97 +993,334 @@ namespace
 
   void Add_Segment(FX_DOWNLOADHINTS *hints, size_t offset, size_t size) {}
 
+  // Where ProcessPdf() reads a document from. |buf| and |len| hold the whole
+  // file when it is in memory, which --mem-document requires. Otherwise
+  // |reader| reads it on demand, or |stream| while it is still arriving
+  // through a pipe.
+  struct PdfInput
+  {
+    const char *buf = nullptr;
+    size_t len = 0;
+    FileContents contents;
+#ifndef _WIN32
+    std::unique_ptr<FileReader> reader;
+    std::unique_ptr<StreamLoader> stream;
+#endif
+  };
+
+  // Opens |filename| for ProcessPdf() the way |options| ask for. "-" streams
+  // the document from stdin, so pages are rendered as soon as their data has
+  // arrived.
+  bool OpenPdfInput(const std::string &filename,
+                    const Options &options,
+                    PdfInput *input)
+  {
+#ifndef _WIN32
+    if (!options.use_load_mem_document)
+    {
+      if (filename == "-")
+      {
+        input->stream = std::make_unique<StreamLoader>(dup(STDIN_FILENO));
+        if (input->stream->WaitForLength())
+          return true;
+        fprintf(stderr, "No input on stdin.\n");
+        return false;
+      }
+      if (options.use_pread)
+      {
+        input->reader = FileReader::Open(
+            filename.c_str(), static_cast<size_t>(options.pread_cache_mb) << 20);
+        return !!input->reader;
+      }
+    }
+#endif
+    input->contents =
+        GetFileContents(filename.c_str(), &input->len, !options.no_mmap);
+    if (!input->contents)
+      return false;
+    if (input->len > std::numeric_limits<unsigned long>::max())
+    {
+      fprintf(stderr, "File too large for this platform: %s\n",
+              filename.c_str());
+      return false;
+    }
+    input->buf = input->contents.get();
+    return true;
+  }
+
   FPDF_PAGE GetPageForIndex(FPDF_FORMFILLINFO *param,
                             FPDF_DOCUMENT doc,
                             int index)
   {
-    FPDF_FORMFILLINFO_PDFiumTest *form_fill_info =
-        ToPDFiumTestFormFillInfo(param);
-    auto &loaded_pages = form_fill_info->loaded_pages;
-    auto iter = loaded_pages.find(index);
-    if (iter != loaded_pages.end())
-      return iter->second.get();
+    return ToPDFiumTestFormFillInfo(param)->page_cache->Get(index);
+  }
 
-    ScopedFPDFPage page(FPDF_LoadPage(doc, index));
-    if (!page)
-      return nullptr;
+  using Clock = std::chrono::steady_clock;
 
-    // Mark the page as loaded first to prevent infinite recursion.
-    FPDF_PAGE page_ptr = page.get();
-    loaded_pages[index] = std::move(page);
+  // The progressive renderer hands control back after this long, so that the
+  // deadlines can be checked in between.
+  constexpr std::chrono::milliseconds kRenderTimeSlice(20);
 
-    FPDF_FORMHANDLE &form_handle = form_fill_info->form_handle;
-    FORM_OnAfterLoadPage(page_ptr, form_handle);
-    FORM_DoPageAAction(page_ptr, form_handle, FPDFPAGE_AACTION_OPEN);
-    return page_ptr;
-  }
+  struct RenderPause final : public IFSDK_PAUSE
+  {
+    Clock::time_point slice_end;
+  };
 
-  // Note, for a client using progressive rendering you'd want to determine if you
-  // need the rendering to pause instead of always saying |true|. This is for
-  // testing to force the renderer to break whenever possible.
   FPDF_BOOL NeedToPauseNow(IFSDK_PAUSE *p)
   {
-    return true;
+    return Clock::now() >= static_cast<RenderPause *>(p)->slice_end;
   }
 
-  bool ProcessPage(const std::string &name,
-                   const std::string &out_name,
-                   FPDF_DOCUMENT doc,
-                   FPDF_FORMHANDLE form,
-                   FPDF_FORMFILLINFO_PDFiumTest *form_fill_info,
-                   const int page_index,
-                   const Options &options,
-                   const std::function<void()> &idler,
-                   bool single_page)
+  enum class PageStatus
   {
-    FPDF_PAGE page = GetPageForIndex(form_fill_info, doc, page_index);
-    if (!page)
-      return false;
-    if (options.save_images)
-      WriteImages(page, name.c_str(), page_index);
-    if (options.save_rendered_images)
-      WriteRenderedImages(doc, page, name.c_str(), page_index);
-    if (options.save_thumbnails)
-      WriteThumbnail(page, name.c_str(), page_index);
-    if (options.save_thumbnails_decoded)
-      WriteDecodedThumbnailStream(page, name.c_str(), page_index);
-    if (options.save_thumbnails_raw)
-      WriteRawThumbnailStream(page, name.c_str(), page_index);
+    kProcessed,
+    kBad,
+    kAbort,
+    // Started by StartPage(), FinishPage() is still to be called.
+    kRendering,
+  };
 
-    ScopedFPDFTextPage text_page(FPDFText_LoadPage(page));
-    double scale = 1.0;
-    if (!options.scale_factor_as_string.empty())
-      std::stringstream(options.scale_factor_as_string) >> scale;
+  // Everything that is kept around while a document is open. Members are
+  // destroyed in reverse order, so |pdf_avail| outlives |doc|, |doc| outlives
+  // |page_cache| and |page_cache| outlives |form|.
+  struct Document
+  {
+    Document(const std::string &name,
+             const std::string &out_name,
+             const PdfInput &input,
+             const Options &options,
+             const std::function<void()> &idler)
+        : name(name),
+          out_name(out_name),
+          input(input),
+          options(options),
+          idler(idler),
+          loader({input.buf, input.len}),
+          bitmap_pool(2 * options.encode_threads + 2)
+    {
+      // The variants were checked when the options were parsed.
+      ParseVariants(options, &variants);
+      if (variants.empty())
+        variants.push_back(RenderVariant{std::string(), options, out_name});
+      for (RenderVariant &variant : variants)
+      {
+        if (variant.name.empty())
+          continue;
+        size_t extension_pos = out_name.find(".png");
+        if (extension_pos == std::string::npos)
+          extension_pos = out_name.size();
+        variant.out_name = out_name.substr(0, extension_pos) + "." +
+                           variant.name + out_name.substr(extension_pos);
+      }
+    }
 
-    auto render_width = static_cast<int>(FPDF_GetPageWidthF(page) * scale);
-    auto render_height = static_cast<int>(FPDF_GetPageHeightF(page) * scale);
+    Document(const Document &) = delete;
+    Document &operator=(const Document &) = delete;
+
+    const std::string name;
+    const std::string out_name;
+    const PdfInput &input;
+    const Options &options;
+    const std::function<void()> idler;
+    // Each page is rendered and written once per variant.
+    std::vector<RenderVariant> variants;
+
+    TestLoader loader;
+    FPDF_FILEACCESS memory_access = {};
+    FX_FILEAVAIL memory_avail = {};
+    FX_DOWNLOADHINTS memory_hints = {};
+    FPDF_FILEACCESS *file_access = nullptr;
+    FX_FILEAVAIL *file_avail = nullptr;
+    FX_DOWNLOADHINTS *hints = nullptr;
+
+    ScopedFPDFAvail pdf_avail;
+    ScopedFPDFDocument doc;
+    bool is_linearized = false;
+    std::unique_ptr<PageCache> page_cache;
+    FPDF_FORMFILLINFO_PDFiumTest form_callbacks = {};
+    ScopedFPDFFormHandle form;
+
+    int first_page = 0;
+    int last_page = 0;
+    bool single_page = false;
+    Clock::time_point deadline = Clock::time_point::max();
+    bool timed_out = false;
+
+    // Page bitmaps reuse the buffers of earlier pages. Enough of them are
+    // kept for every page the pipeline may have in flight.
+    BitmapPool bitmap_pool;
+    // Created on first use, so that each forked page job starts its own
+    // threads.
+    std::unique_ptr<RenderPipeline> pipeline;
+
+    ProcessResult result;
+  };
 
-    auto image_width = render_width;
-    auto image_height = render_height;
+  // Data in memory is always available; a stream is waited for instead of
+  // asking PDFium again right away. Returns false if there is nothing to wait
+  // for.
+  bool WaitForData(const Document &document)
+  {
+#ifndef _WIN32
+    if (document.input.stream)
+    {
+      document.input.stream->WaitForData();
+      return true;
+    }
+#endif
+    return false;
+  }
 
-    int setting_width = -1;
-    if (!options.width_as_string.empty())
-      std::stringstream(options.width_as_string) >> setting_width;
-    int setting_height = -1;
-    if (!options.height_as_string.empty())
-      std::stringstream(options.height_as_string) >> setting_height;
+  // A page from StartPage() to FinishPage(). Its progressive render advances
+  // one ContinuePage() at a time, so other work can happen in between.
+  struct PageRender
+  {
+    int page_index = -1;
+    FPDF_PAGE page = nullptr;
+    ScopedFPDFTextPage text_page;
+    // The variant being rendered, an index into Document::variants.
+    size_t variant = 0;
+    // Set once a variant of the page failed.
+    bool failed = false;
+    ScopedFPDFBitmap bitmap;
+    int render_width = 0;
+    int render_height = 0;
+    int image_width = 0;
+    int image_height = 0;
+    int flags = 0;
+    RenderPause pause;
+    Clock::time_point deadline;
+    bool rendering = false;
+    bool completed = true;
+    // Set when the page is rendered in bands, see StartBands(). |bitmap| then
+    // holds one band.
+    bool banded = false;
+    std::unique_ptr<image_diff_png::BGRAPNGRowWriter> band_writer;
+    std::unique_ptr<TilePyramid> tile_pyramid;
+    std::string band_file_name;
+    FPDF_DWORD fill_color = 0;
+    int band_top = 0;
+    // The region of the page in the bitmap, see PageGeometry.
+    int crop_x = 0;
+    int crop_y = 0;
+    // Set if |bitmap| holds the embedded thumbnail rather than a render.
+    bool from_thumbnail = false;
+    // Set if the page failed and said so already.
+    bool reported = false;
+  };
 
-    if (setting_height > 0 || setting_width > 0)
-    {
-      int calc_aspect_height = render_height * setting_width / render_width;
-      int calc_aspect_width = render_width * setting_height / render_height;
+  // Pixel sizes of a page: it is drawn at |render_width| x |render_height|
+  // into a bitmap of |image_width| x |image_height|. With --crop the bitmap
+  // only holds the region of the page whose top left corner is at |crop_x|,
+  // |crop_y|.
+  struct PageGeometry
+  {
+    int render_width = 0;
+    int render_height = 0;
+    int image_width = 0;
+    int image_height = 0;
+    int crop_x = 0;
+    int crop_y = 0;
+    // Pixels per point the page is drawn at.
+    double scale = 1.0;
+    // Set if the budget made the page smaller than the options asked for.
+    bool downscaled = false;
+    // Set if nothing of the page is inside the crop rectangle.
+    bool outside = false;
+  };
 
-      if (setting_height < 0)
-      {
-        setting_height = calc_aspect_height;
-      }
-      else if (setting_width < 0)
-      {
-        setting_width = calc_aspect_width;
-      }
+  // Bytes of a BitmapPool bitmap of |width| x |height| pixels of |format|.
+  int64_t BitmapBytes(int64_t width, int64_t height, int format)
+  {
+    int64_t bytes_per_pixel = format == FPDFBitmap_BGR ? 3 : 4;
+    return (width * bytes_per_pixel + 63) / 64 * 64 * height;
+  }
 
-      if (options.maintain_aspect_ratio)
-      {
+  // Pages are rendered in bands when they are written to PNG files and
+  // --band-height or --crop are given, and always for tile pyramids.
+  bool UseBands(const Options &options)
+  {
+    return ((options.band_height > 0 || options.crop) &&
+            options.output_format == OutputFormat::kPng) ||
+           options.output_format == OutputFormat::kDzi;
+  }
+
+  // The rows of one band, 0 for the whole (cropped) page.
+  int BandHeight(const Options &options)
+  {
+    if (options.band_height > 0)
+      return options.band_height;
+    return options.output_format == OutputFormat::kDzi ? options.tile_size : 0;
+  }
+
+  // The format of the bitmap |page| is rendered into. Pages without
+  // transparency need no alpha channel, and are written as RGB: whole pages
+  // go into 24 bit bitmaps, bands into 32 bit ones for the row writer and the
+  // tile pyramid.
+  int PageBitmapFormat(FPDF_PAGE page, const Options &options)
+  {
+    if (FPDFPage_HasTransparency(page))
+      return FPDFBitmap_BGRA;
+    return UseBands(options) ? FPDFBitmap_BGRx : FPDFBitmap_BGR;
+  }
+
+  // Computes the geometry of |page| from --scale, --width and --height, then
+  // shrinks it as little as needed to stay within --max-pixels, and within
+  // --max-memory with |bitmaps| bitmaps alive at once. With bands only one
+  // band has to fit into memory. Returns false if the page is too large to be
+  // rendered at all.
+  bool ComputePageGeometry(FPDF_PAGE page,
+                           const Options &options,
+                           int bitmaps,
+                           PageGeometry *geometry)
+  {
+    double scale = 1.0;
+    if (!options.scale_factor_as_string.empty())
+      std::stringstream(options.scale_factor_as_string) >> scale;
+
+    // 64 bit, so that oversized options cannot overflow before the budget is
+    // applied.
+    auto render_width = static_cast<int64_t>(FPDF_GetPageWidthF(page) * scale);
+    auto render_height = static_cast<int64_t>(FPDF_GetPageHeightF(page) * scale);
+
+    // --sizes renders at the largest size, the longer edge rounded to exactly
+    // that many pixels.
+    if (!options.sizes.empty())
+    {
+      float page_width = FPDF_GetPageWidthF(page);
+      float page_height = FPDF_GetPageHeightF(page);
+      scale = options.sizes[0] / std::max(page_width, page_height);
+      render_width = llround(page_width * scale);
+      render_height = llround(page_height * scale);
+    }
+
+    auto image_width = render_width;
+    auto image_height = render_height;
+
+    int64_t setting_width = -1;
+    if (!options.width_as_string.empty() && options.sizes.empty())
+      std::stringstream(options.width_as_string) >> setting_width;
+    int64_t setting_height = -1;
+    if (!options.height_as_string.empty() && options.sizes.empty())
+      std::stringstream(options.height_as_string) >> setting_height;
+
+    if ((setting_height > 0 || setting_width > 0) && render_width > 0 &&
+        render_height > 0)
+    {
+      int64_t calc_aspect_height = render_height * setting_width / render_width;
+      int64_t calc_aspect_width = render_width * setting_height / render_height;
+
+      if (setting_height < 0)
+      {
+        setting_height = calc_aspect_height;
+      }
+      else if (setting_width < 0)
+      {
+        setting_width = calc_aspect_width;
+      }
+
+      if (options.maintain_aspect_ratio)
+      {
         if (options.allow_enlargement)
         {
           render_height = std::max(setting_height, calc_aspect_height);
@@ -610,47 +1344,707 @@ namespace
         image_height = setting_height;
       }
     }
+    if (image_width <= 0 || image_height <= 0)
+      return false;
+
+    // The region of the image that is kept, in output pixels.
+    double crop_left = 0;
+    double crop_top = 0;
+    double crop_right = static_cast<double>(image_width);
+    double crop_bottom = static_cast<double>(image_height);
+    if (options.crop)
+    {
+      double x_scale = 1.0;
+      double y_scale = 1.0;
+      if (options.crop_in_points)
+      {
+        x_scale = render_width / std::max(1.0f, FPDF_GetPageWidthF(page));
+        y_scale = render_height / std::max(1.0f, FPDF_GetPageHeightF(page));
+      }
+      crop_left = std::max(crop_left, round(options.crop_rect[0] * x_scale));
+      crop_top = std::max(crop_top, round(options.crop_rect[1] * y_scale));
+      crop_right = std::min(
+          crop_right,
+          round((options.crop_rect[0] + options.crop_rect[2]) * x_scale));
+      crop_bottom = std::min(
+          crop_bottom,
+          round((options.crop_rect[1] + options.crop_rect[3]) * y_scale));
+      if (crop_right <= crop_left || crop_bottom <= crop_top)
+      {
+        geometry->outside = true;
+        return false;
+      }
+    }
+    auto crop_width = static_cast<int64_t>(crop_right - crop_left);
+    auto crop_height = static_cast<int64_t>(crop_bottom - crop_top);
+
+    // The page keeps its aspect ratio, so the area shrinks with the square
+    // of the factor, and a band only with the factor. Rounding down and the
+    // row alignment are fixed up by shrinking a little further.
+    int band_height = UseBands(options) ? BandHeight(options) : 0;
+    bool bands = band_height > 0;
+    int format = PageBitmapFormat(page, options);
+    auto bitmap_bytes = [band_height, bands, format](int64_t width,
+                                                     int64_t height)
+    {
+      return BitmapBytes(
+          width, bands ? std::min<int64_t>(height, band_height) : height,
+          format);
+    };
+    int64_t max_bytes =
+        options.max_memory_mb > 0 ? (options.max_memory_mb << 20) / bitmaps : 0;
+    double factor = 1.0;
+    double pixels = static_cast<double>(crop_width) * crop_height;
+    if (options.max_pixels > 0 && pixels > options.max_pixels)
+      factor = std::min(factor, sqrt(options.max_pixels / pixels));
+    double bytes = static_cast<double>(bitmap_bytes(crop_width, crop_height));
+    if (max_bytes > 0 && bytes > max_bytes)
+    {
+      factor = std::min(factor, bands && crop_height > band_height
+                                    ? max_bytes / bytes
+                                    : sqrt(max_bytes / bytes));
+    }
+    if (factor < 1.0)
+    {
+      int64_t width;
+      int64_t height;
+      while (true)
+      {
+        width = std::max<int64_t>(1, static_cast<int64_t>(crop_width * factor));
+        height = std::max<int64_t>(1, static_cast<int64_t>(crop_height * factor));
+        if ((options.max_pixels <= 0 || width * height <= options.max_pixels) &&
+            (max_bytes <= 0 || bitmap_bytes(width, height) <= max_bytes))
+        {
+          break;
+        }
+        if (width == 1 && height == 1)
+          return false;
+        factor *= 0.99;
+      }
+      render_width = static_cast<int64_t>(render_width * factor);
+      render_height = static_cast<int64_t>(render_height * factor);
+      crop_left = floor(crop_left * factor);
+      crop_top = floor(crop_top * factor);
+      crop_width = width;
+      crop_height = height;
+      geometry->downscaled = true;
+    }
+
+    if (crop_width > std::numeric_limits<int>::max() ||
+        crop_height > std::numeric_limits<int>::max() ||
+        render_width > std::numeric_limits<int>::max() ||
+        render_height > std::numeric_limits<int>::max())
+    {
+      return false;
+    }
+    geometry->render_width = static_cast<int>(render_width);
+    geometry->render_height = static_cast<int>(render_height);
+    geometry->image_width = static_cast<int>(crop_width);
+    geometry->image_height = static_cast<int>(crop_height);
+    geometry->crop_x = static_cast<int>(crop_left);
+    geometry->crop_y = static_cast<int>(crop_top);
+    float page_width = FPDF_GetPageWidthF(page);
+    geometry->scale = page_width > 0 ? render_width / page_width : scale;
+    return true;
+  }
+
+  // Renders the |width| x |height| pixels at |left|, |top| of |page| drawn at
+  // |render_width| x |render_height|, forms included, into the top left
+  // corner of |bitmap|. Only that region is rasterized.
+  void RenderPageRegion(FPDF_BITMAP bitmap,
+                        FPDF_PAGE page,
+                        FPDF_FORMHANDLE form,
+                        int render_width,
+                        int render_height,
+                        int left,
+                        int top,
+                        int width,
+                        int height,
+                        FPDF_DWORD fill_color,
+                        int flags)
+  {
+    FPDFBitmap_FillRect(bitmap, 0, 0, width, height, fill_color);
+
+    // FPDF_RenderPageBitmapWithMatrix() starts out at one pixel per point.
+    float page_width = std::max(1.0f, FPDF_GetPageWidthF(page));
+    float page_height = std::max(1.0f, FPDF_GetPageHeightF(page));
+    FS_MATRIX matrix = {render_width / page_width, 0, 0,
+                        render_height / page_height, static_cast<float>(-left),
+                        static_cast<float>(-top)};
+    FS_RECTF clip = {0, 0, static_cast<float>(width),
+                     static_cast<float>(height)};
+    FPDF_RenderPageBitmapWithMatrix(bitmap, page, &matrix, &clip, flags);
+    FPDF_FFLDraw(form, bitmap, page, -left, -top, render_width, render_height,
+                 0, flags);
+  }
+
+  // Sets up |render| to be rendered in bands of BandHeight() rows, each of
+  // them written to the PNG file or the tile pyramid as soon as it is
+  // rendered, so that only one band is ever in memory. Bands are rendered
+  // with RenderPageRegion() rather than progressively; ContinuePage() renders
+  // one band at a time.
+  PageStatus StartBands(Document *document, PageRender *render)
+  {
+    const Options &options = document->variants[render->variant].options;
+    render->banded = true;
+    int format = PageBitmapFormat(render->page, options);
+    bool alpha = format == FPDFBitmap_BGRA;
+    int band_height = BandHeight(options) > 0
+                          ? std::min(BandHeight(options), render->image_height)
+                          : render->image_height;
+    render->bitmap =
+        document->bitmap_pool.Acquire(render->image_width, band_height, format);
+    // FinishPage() reports a page without a bitmap.
+    if (!render->bitmap)
+      return PageStatus::kRendering;
+    render->fill_color = alpha ? 0x00000000 : 0xFFFFFFFF;
+    render->flags = PageRenderFlagsFromOptions(options);
+
+    const std::string &out_name = document->variants[render->variant].out_name;
+    size_t extension_pos = out_name.find(".png");
+    if (extension_pos == std::string::npos)
+      extension_pos = out_name.size();
+    int num = document->single_page ? -1 : render->page_index;
+    // Tiles are encoded on threads of their own, and a PNG written in bands
+    // row by row.
+    image_diff_png::EncodeOptions encode_options =
+        EncodeOptionsFromOptions(options);
+    encode_options.threads = 1;
+    if (options.output_format == OutputFormat::kDzi)
+    {
+      // Named like the PNG files would be.
+      std::string name = out_name.substr(0, extension_pos);
+      if (num > 0)
+        name += "." + std::to_string(num);
+      int encode_threads = document->options.encode_threads;
+      int threads = encode_threads > 0
+                        ? encode_threads
+                        : static_cast<int>(std::thread::hardware_concurrency());
+      auto pyramid = std::make_unique<TilePyramid>(
+          name, render->image_width, render->image_height, format,
+          options.tile_size, threads, encode_options);
+      if (!pyramid->Open())
+        return PageStatus::kRendering;
+      render->tile_pyramid = std::move(pyramid);
+      render->rendering = true;
+      return PageStatus::kRendering;
+    }
 
-    int alpha = FPDFPage_HasTransparency(page) ? 1 : 0;
-    ScopedFPDFBitmap bitmap(FPDFBitmap_Create(image_width, image_height, alpha));
+    render->band_file_name =
+        GetPngFileName(out_name.substr(0, extension_pos).c_str(), num);
+    if (render->band_file_name.empty())
+      return PageStatus::kRendering;
 
-    if (bitmap)
+    auto writer = std::make_unique<image_diff_png::BGRAPNGRowWriter>();
+    if (!writer->Open(render->band_file_name, render->image_width,
+                      render->image_height, /*discard_transparency=*/!alpha,
+                      encode_options))
     {
-      FPDF_DWORD fill_color = alpha ? 0x00000000 : 0xFFFFFFFF;
-      FPDFBitmap_FillRect(bitmap.get(), 0, 0, image_width, image_height, fill_color);
+      remove(render->band_file_name.c_str());
+      return PageStatus::kRendering;
+    }
+    render->band_writer = std::move(writer);
+    render->rendering = true;
+    return PageStatus::kRendering;
+  }
+
+  // Hands |rows| rows of a band to the PNG file or the tile pyramid.
+  bool WriteBandRows(PageRender *render,
+                     pdfium::span<const uint8_t> input,
+                     int rows,
+                     int stride)
+  {
+    if (render->tile_pyramid)
+      return render->tile_pyramid->AddRows(input.data(), rows, stride);
+    return render->band_writer->WriteRows(input, rows, stride);
+  }
+
+  // Renders the next band of |render| with its forms and writes it. Returns
+  // true once the last band is written or writing failed.
+  bool RenderNextBand(Document *document, PageRender *render)
+  {
+    FPDF_BITMAP bitmap = render->bitmap.get();
+    int top = render->band_top;
+    int rows = std::min(FPDFBitmap_GetHeight(bitmap),
+                        render->image_height - top);
+    const Options &options = document->variants[render->variant].options;
+    RenderPageRegion(bitmap, render->page,
+                     options.no_forms ? nullptr : document->form.get(),
+                     render->render_width, render->render_height,
+                     render->crop_x, render->crop_y + top, render->image_width,
+                     rows, render->fill_color, render->flags);
+
+    int stride = FPDFBitmap_GetStride(bitmap);
+    auto input = pdfium::make_span(
+        static_cast<const uint8_t *>(FPDFBitmap_GetBuffer(bitmap)),
+        static_cast<size_t>(stride) * rows);
+    if (!WriteBandRows(render, input, rows, stride))
+      return true;
+    render->band_top += rows;
+    return render->band_top >= render->image_height;
+  }
 
-      int flags = PageRenderFlagsFromOptions(options);
-      if (options.render_oneshot)
+  // Writes the rows of |render| that were not rendered as blank ones.
+  void WriteBlankBands(PageRender *render)
+  {
+    FPDF_BITMAP bitmap = render->bitmap.get();
+    int band_height = FPDFBitmap_GetHeight(bitmap);
+    int stride = FPDFBitmap_GetStride(bitmap);
+    FPDFBitmap_FillRect(bitmap, 0, 0, render->image_width, band_height,
+                        render->fill_color);
+    auto input = pdfium::make_span(
+        static_cast<const uint8_t *>(FPDFBitmap_GetBuffer(bitmap)),
+        static_cast<size_t>(stride) * band_height);
+    while (render->band_top < render->image_height)
+    {
+      int rows = std::min(band_height, render->image_height - render->band_top);
+      if (!WriteBandRows(render, input, rows, stride))
+        return;
+      render->band_top += rows;
+    }
+  }
+
+  // Fills |render->bitmap| with the embedded thumbnail of the page, scaled to
+  // the render size in the top left corner of the image, like a render.
+  // Returns false if there is no thumbnail that large, and the page has to be
+  // rendered.
+  bool StartFromThumbnail(Document *document, PageRender *render)
+  {
+    int render_width = render->render_width;
+    int render_height = render->render_height;
+    if (render_width > render->image_width ||
+        render_height > render->image_height)
+    {
+      return false;
+    }
+    ScopedFPDFBitmap thumbnail(FPDFPage_GetThumbnailAsBitmap(render->page));
+    if (!thumbnail)
+      return false;
+    int width = FPDFBitmap_GetWidth(thumbnail.get());
+    int height = FPDFBitmap_GetHeight(thumbnail.get());
+    if (width < render_width || height < render_height)
+      return false;
+
+    int format = FPDFBitmap_GetFormat(thumbnail.get());
+    int bytes_per_pixel = 0;
+    switch (format)
+    {
+    case FPDFBitmap_Gray:
+      bytes_per_pixel = 1;
+      break;
+    case FPDFBitmap_BGR:
+      bytes_per_pixel = 3;
+      break;
+    case FPDFBitmap_BGRx:
+    case FPDFBitmap_BGRA:
+      bytes_per_pixel = 4;
+      break;
+    default:
+      return false;
+    }
+    const auto *pixels =
+        static_cast<const uint8_t *>(FPDFBitmap_GetBuffer(thumbnail.get()));
+    int stride = FPDFBitmap_GetStride(thumbnail.get());
+
+    // Anything but BGRA is made BGR for the scaler first, and either is
+    // swapped to RGB(A) like the renders with --reverse-byte-order;
+    // thumbnails are small.
+    bool alpha = format == FPDFBitmap_BGRA;
+    int output_bytes = alpha ? 4 : 3;
+    bool rgba = document->variants[render->variant].options.reverse_byte_order;
+    std::vector<uint8_t> expanded;
+    if (!alpha || rgba)
+    {
+      expanded.resize(static_cast<size_t>(width) * height * output_bytes);
+      int red = rgba ? 0 : 2;
+      for (int y = 0; y < height; ++y)
       {
-        // Note, client programs probably want to use this method instead of the
-        // progressive calls. The progressive calls are if you need to pause the
-        // rendering to update the UI, the PDF renderer will break when possible.
-        FPDF_RenderPageBitmap(bitmap.get(), page, 0, 0, render_width, render_height, 0, flags);
+        const uint8_t *in = pixels + static_cast<size_t>(y) * stride;
+        uint8_t *out =
+            expanded.data() + static_cast<size_t>(y) * width * output_bytes;
+        for (int x = 0; x < width;
+             ++x, in += bytes_per_pixel, out += output_bytes)
+        {
+          out[2 - red] = in[0];
+          out[1] = in[bytes_per_pixel > 1 ? 1 : 0];
+          out[red] = in[bytes_per_pixel > 1 ? 2 : 0];
+          if (alpha)
+            out[3] = in[3];
+        }
       }
-      else
+      pixels = expanded.data();
+      stride = width * output_bytes;
+    }
+
+    int bitmap_format = alpha ? FPDFBitmap_BGRA : FPDFBitmap_BGR;
+    render->bitmap =
+        document->pipeline
+            ? document->pipeline->AcquireBitmap(
+                  render->image_width, render->image_height, bitmap_format)
+            : document->bitmap_pool.Acquire(
+                  render->image_width, render->image_height, bitmap_format);
+    if (!render->bitmap)
+      return false;
+    // Around a page that keeps its aspect ratio, the image is filled like
+    // the bitmap of a render.
+    if (render_width < render->image_width ||
+        render_height < render->image_height)
+    {
+      FPDFBitmap_FillRect(render->bitmap.get(), 0, 0, render->image_width,
+                          render->image_height,
+                          alpha ? 0x00000000 : 0xFFFFFFFF);
+    }
+    auto *output =
+        static_cast<uint8_t *>(FPDFBitmap_GetBuffer(render->bitmap.get()));
+    int output_stride = FPDFBitmap_GetStride(render->bitmap.get());
+    if (alpha)
+    {
+      image_resize::ResizeBGRAArea(pixels, width, height, stride,
+                                   /*has_alpha=*/true, output, render_width,
+                                   render_height, output_stride);
+    }
+    else
+    {
+      image_resize::ResizeBGRArea(pixels, width, height, stride, output,
+                                  render_width, render_height, output_stride);
+    }
+    render->from_thumbnail = true;
+    return true;
+  }
+
+  // Returns when the render of a page, or of its next variant, has to stop.
+  Clock::time_point PageDeadline(const Document &document)
+  {
+    const Options &options = document.options;
+    if (options.page_timeout <= 0)
+      return document.deadline;
+    return std::min(document.deadline,
+                    Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                                       std::chrono::duration<double>(
+                                           options.page_timeout)));
+  }
+
+  // Starts rendering the current variant of the page loaded by StartPage().
+  // There is always a render to finish, so this returns kRendering.
+  PageStatus StartVariant(Document *document, PageRender *render)
+  {
+    const Options &options = document->variants[render->variant].options;
+    FPDF_PAGE page = render->page;
+    int page_index = render->page_index;
+    PageGeometry geometry;
+    // Scheduling options come from the command line, not the variant.
+    int encode_threads = document->options.encode_threads;
+    if (!ComputePageGeometry(page, options,
+                             UseBands(options) ? 1 : 2 * encode_threads + 1,
+                             &geometry))
+    {
+      if (geometry.outside)
       {
-        IFSDK_PAUSE pause;
-        pause.version = 1;
-        pause.NeedToPauseNow = &NeedToPauseNow;
+        fprintf(stderr, "Page %d is outside of the crop rectangle.\n",
+                page_index);
+        render->reported = true;
+      }
+      // FinishPage() reports a page without a bitmap.
+      return PageStatus::kRendering;
+    }
+    if (geometry.downscaled)
+    {
+      fprintf(stderr, "Page %d is rendered at scale %g to fit the budget.\n",
+              page_index, geometry.scale);
+    }
+    int render_width = geometry.render_width;
+    int render_height = geometry.render_height;
+    int image_width = geometry.image_width;
+    int image_height = geometry.image_height;
+    render->render_width = render_width;
+    render->render_height = render_height;
+    render->image_width = image_width;
+    render->image_height = image_height;
+    render->crop_x = geometry.crop_x;
+    render->crop_y = geometry.crop_y;
+    if (!UseBands(options) && options.use_thumbnails &&
+        options.output_format == OutputFormat::kPng &&
+        StartFromThumbnail(document, render))
+    {
+      fprintf(stderr, "Page %d is taken from its embedded thumbnail.\n",
+              page_index);
+      return PageStatus::kRendering;
+    }
+
+    // The text page is loaded by the first variant that renders, if any.
+    if (!render->text_page)
+      render->text_page.reset(FPDFText_LoadPage(page));
+    if (UseBands(options))
+      return StartBands(document, render);
+
+    int format = PageBitmapFormat(page, options);
+    render->bitmap =
+        document->pipeline
+            ? document->pipeline->AcquireBitmap(image_width, image_height, format)
+            : document->bitmap_pool.Acquire(image_width, image_height, format);
+    // FinishPage() reports a page without a bitmap.
+    if (!render->bitmap)
+      return PageStatus::kRendering;
+
+    FPDF_DWORD fill_color =
+        format == FPDFBitmap_BGRA ? 0x00000000 : 0xFFFFFFFF;
+    FPDFBitmap_FillRect(render->bitmap.get(), 0, 0, image_width, image_height, fill_color);
+
+    render->flags = PageRenderFlagsFromOptions(options);
+    if (options.render_oneshot)
+    {
+      // Note, client programs probably want to use this method instead of the
+      // progressive calls. The progressive calls are if you need to pause the
+      // rendering to update the UI, the PDF renderer will break when possible.
+      FPDF_RenderPageBitmap(render->bitmap.get(), page, 0, 0, render_width, render_height, 0, render->flags);
+      return PageStatus::kRendering;
+    }
 
-        // Client programs will be setting these values when rendering.
-        // This is a sample color scheme with distinct colors.
-        // Used only when |options.forced_color| is true.
-        const FPDF_COLORSCHEME color_scheme{
-            /*path_fill_color=*/0xFFFF0000, /*path_stroke_color=*/0xFF00FF00,
-            /*text_fill_color=*/0xFF0000FF, /*text_stroke_color=*/0xFF00FFFF};
+    render->pause.version = 1;
+    render->pause.NeedToPauseNow = &NeedToPauseNow;
+    render->pause.slice_end =
+        std::min(Clock::now() + kRenderTimeSlice, render->deadline);
+
+    // Client programs will be setting these values when rendering.
+    // This is a sample color scheme with distinct colors.
+    // Used only when |options.forced_color| is true.
+    const FPDF_COLORSCHEME color_scheme{
+        /*path_fill_color=*/0xFFFF0000, /*path_stroke_color=*/0xFF00FF00,
+        /*text_fill_color=*/0xFF0000FF, /*text_stroke_color=*/0xFF00FFFF};
+
+    int rv = FPDF_RenderPageBitmapWithColorScheme_Start(
+        render->bitmap.get(), page, 0, 0, render_width, render_height, 0,
+        render->flags, options.forced_color ? &color_scheme : nullptr,
+        &render->pause);
+    render->rendering = rv == FPDF_RENDER_TOBECONTINUED;
+    return PageStatus::kRendering;
+  }
 
-        int rv = FPDF_RenderPageBitmapWithColorScheme_Start(
-            bitmap.get(), page, 0, 0, render_width, render_height, 0, flags,
-            options.forced_color ? &color_scheme : nullptr, &pause);
-        while (rv == FPDF_RENDER_TOBECONTINUED)
-          rv = FPDF_RenderPage_Continue(page, &pause);
+  // Loads page |page_index| and starts rendering its first variant. Unless
+  // this returns kRendering there is nothing left to do for the page;
+  // otherwise ContinuePage() is called until it returns true, then
+  // FinishPage(), for as long as that returns kRendering.
+  PageStatus StartPage(Document *document, int page_index, PageRender *render)
+  {
+    const Options &options = document->options;
+    if (Clock::now() >= document->deadline)
+    {
+      if (!document->timed_out)
+      {
+        fprintf(stderr, "Document timed out, skipping page %d and up.\n",
+                page_index);
+      }
+      document->timed_out = true;
+      return PageStatus::kBad;
+    }
+    if (document->is_linearized)
+    {
+      FPDF_AVAIL pdf_avail = document->pdf_avail.get();
+      int avail_status =
+          FPDFAvail_IsPageAvail(pdf_avail, page_index, document->hints);
+      while (avail_status == PDF_DATA_NOTAVAIL && WaitForData(*document))
+      {
+        avail_status =
+            FPDFAvail_IsPageAvail(pdf_avail, page_index, document->hints);
       }
 
-      FPDF_FFLDraw(form, bitmap.get(), page, 0, 0, render_width, render_height, 0, flags);
-      idler();
+      if (avail_status == PDF_DATA_ERROR)
+      {
+        fprintf(stderr, "Unknown error in checking if page %d is available.\n",
+                page_index);
+        return PageStatus::kAbort;
+      }
+    }
+    if (options.encode_threads > 0 && !document->pipeline)
+    {
+      document->pipeline = std::make_unique<RenderPipeline>(
+          options.encode_threads, 2 * options.encode_threads,
+          &document->bitmap_pool);
+    }
+
+    render->page_index = page_index;
+    render->deadline = PageDeadline(*document);
+
+    FPDF_PAGE page = document->page_cache->Acquire(page_index);
+    if (!page)
+      return PageStatus::kBad;
+    render->page = page;
+
+    const std::string &name = document->name;
+    if (options.save_images)
+      WriteImages(page, name.c_str(), page_index);
+    if (options.save_rendered_images)
+      WriteRenderedImages(document->doc.get(), page, name.c_str(), page_index);
+    if (options.save_thumbnails)
+      WriteThumbnail(page, name.c_str(), page_index);
+    if (options.save_thumbnails_decoded)
+      WriteDecodedThumbnailStream(page, name.c_str(), page_index);
+    if (options.save_thumbnails_raw)
+      WriteRawThumbnailStream(page, name.c_str(), page_index);
 
-      if (!options.render_oneshot)
+    return StartVariant(document, render);
+  }
+
+  // Renders |render| further until |slice_end|. Returns true once it is done,
+  // or its deadline passed and it never will be.
+  bool ContinuePage(Document *document,
+                    PageRender *render,
+                    Clock::time_point slice_end)
+  {
+    if (!render->rendering)
+      return true;
+    if (Clock::now() >= render->deadline)
+    {
+      render->rendering = false;
+      render->completed = false;
+      return true;
+    }
+    if (render->banded)
+    {
+      render->rendering = !RenderNextBand(document, render);
+      return !render->rendering;
+    }
+    render->pause.slice_end = std::min(slice_end, render->deadline);
+    render->rendering = FPDF_RenderPage_Continue(render->page, &render->pause) ==
+                        FPDF_RENDER_TOBECONTINUED;
+    return !render->rendering;
+  }
+
+  // Writes |bitmap| as GetPngFileName(name, num), on the pipeline if there is
+  // one, and gives it back to the pool.
+  void WritePageBitmap(Document *document, ScopedFPDFBitmap bitmap,
+                       const std::string &name, int num,
+                       const image_diff_png::EncodeOptions &encode_options)
+  {
+    if (document->pipeline)
+    {
+      document->pipeline->Submit(std::move(bitmap), name, num, encode_options);
+      return;
+    }
+    WritePng(name.c_str(), num, FPDFBitmap_GetBuffer(bitmap.get()),
+             FPDFBitmap_GetStride(bitmap.get()), FPDFBitmap_GetWidth(bitmap.get()),
+             FPDFBitmap_GetHeight(bitmap.get()),
+             FPDFBitmap_GetFormat(bitmap.get()), encode_options);
+    document->bitmap_pool.Release(std::move(bitmap));
+  }
+
+  // Returns a copy of |bitmap| scaled down by area averaging so that its
+  // longer edge is |size| pixels, or nullptr if there is no memory for it.
+  // Bitmaps that are no larger than that are copied as they are.
+  ScopedFPDFBitmap ScaleBitmap(Document *document, FPDF_BITMAP bitmap, int size)
+  {
+    int width = FPDFBitmap_GetWidth(bitmap);
+    int height = FPDFBitmap_GetHeight(bitmap);
+    int scaled_width = width;
+    int scaled_height = height;
+    if (std::max(width, height) > size)
+    {
+      double factor = static_cast<double>(size) / std::max(width, height);
+      scaled_width = std::max(1, static_cast<int>(lround(width * factor)));
+      scaled_height = std::max(1, static_cast<int>(lround(height * factor)));
+    }
+    int format = FPDFBitmap_GetFormat(bitmap);
+    ScopedFPDFBitmap scaled =
+        document->pipeline
+            ? document->pipeline->AcquireBitmap(scaled_width, scaled_height, format)
+            : document->bitmap_pool.Acquire(scaled_width, scaled_height, format);
+    if (!scaled)
+      return nullptr;
+    const auto *input = static_cast<const uint8_t *>(FPDFBitmap_GetBuffer(bitmap));
+    auto *output = static_cast<uint8_t *>(FPDFBitmap_GetBuffer(scaled.get()));
+    if (format == FPDFBitmap_BGR)
+    {
+      image_resize::ResizeBGRArea(input, width, height,
+                                  FPDFBitmap_GetStride(bitmap), output,
+                                  scaled_width, scaled_height,
+                                  FPDFBitmap_GetStride(scaled.get()));
+    }
+    else
+    {
+      image_resize::ResizeBGRAArea(input, width, height,
+                                   FPDFBitmap_GetStride(bitmap),
+                                   format == FPDFBitmap_BGRA, output,
+                                   scaled_width, scaled_height,
+                                   FPDFBitmap_GetStride(scaled.get()));
+    }
+    return scaled;
+  }
+
+  // Draws the forms onto a rendered page and writes it. Starts the next
+  // variant if there is one and returns kRendering; otherwise closes the page.
+  PageStatus FinishPage(Document *document, PageRender *render)
+  {
+    const RenderVariant &variant = document->variants[render->variant];
+    const Options &options = variant.options;
+    const std::function<void()> &idler = document->idler;
+    const std::string &out_name = variant.out_name;
+    FPDF_FORMHANDLE form = document->form.get();
+    FPDF_PAGE page = render->page;
+    int page_index = render->page_index;
+    int render_width = render->render_width;
+    int render_height = render->render_height;
+    int image_width = render->image_width;
+    int image_height = render->image_height;
+    bool single_page = document->single_page;
+    RenderPipeline *pipeline = document->pipeline.get();
+    ScopedFPDFBitmap &bitmap = render->bitmap;
+
+    image_diff_png::EncodeOptions encode_options =
+        EncodeOptionsFromOptions(options);
+
+    bool rendered = !!bitmap;
+
+    if (render->banded && bitmap)
+    {
+      // The bands are written already, forms included.
+      bool completed = render->completed;
+      if (!completed)
+      {
+        fprintf(stderr, "Page %d timed out%s.\n", page_index,
+                options.partial_output ? ", writing what was rendered" : "");
+        rendered = false;
+      }
+      bool keep = (render->band_writer || render->tile_pyramid) &&
+                  (completed || options.partial_output);
+      if (keep && !completed)
+        WriteBlankBands(render);
+      if (keep && !(render->tile_pyramid ? render->tile_pyramid->Finish()
+                                         : render->band_writer->Finish()))
+      {
+        keep = false;
+        rendered = false;
+      }
+      if (!keep)
+      {
+        // A pyramid without its descriptor is left behind, but not used.
+        render->tile_pyramid.reset();
+        if (render->band_writer)
+        {
+          render->band_writer.reset();
+          remove(render->band_file_name.c_str());
+        }
+        rendered = false;
+      }
+      document->bitmap_pool.Release(std::move(bitmap));
+    }
+    else if (bitmap)
+    {
+      int flags = render->flags;
+      bool completed = render->completed;
+      if (!completed)
+      {
+        fprintf(stderr, "Page %d timed out%s.\n", page_index,
+                options.partial_output ? ", writing what was rendered" : "");
+        rendered = false;
+      }
+
+      if (!options.no_forms && !render->from_thumbnail)
+      {
+        FPDF_FFLDraw(form, bitmap.get(), page, 0, 0, render_width, render_height, 0, flags);
+        idler();
+      }
+
+      if (!options.render_oneshot && !render->from_thumbnail)
       {
         FPDF_RenderPage_Close(page);
         idler();
@@ -661,7 +2055,11 @@ namespace
 
       std::string image_file_name;
 
-      switch (options.output_format)
+      // A page that timed out is only written with --partial-output.
+      OutputFormat output_format = completed || options.partial_output
+                                       ? options.output_format
+                                       : OutputFormat::kNone;
+      switch (output_format)
       {
 
       case OutputFormat::kPng:
@@ -671,109 +2069,310 @@ namespace
         {
           extension_pos = out_name.size();
         }
+        std::string name = out_name.substr(0, extension_pos);
+        int num = single_page ? -1 : page_index;
+        if (!options.sizes.empty())
+        {
+          // The smaller sizes are scaled down from the page before it is
+          // handed off, largest last.
+          for (size_t i = options.sizes.size() - 1; i > 0; --i)
+          {
+            ScopedFPDFBitmap scaled =
+                ScaleBitmap(document, bitmap.get(), options.sizes[i]);
+            if (!scaled)
+            {
+              fprintf(stderr, "Page %d could not be scaled to %d pixels.\n",
+                      page_index, options.sizes[i]);
+              rendered = false;
+              continue;
+            }
+            WritePageBitmap(document, std::move(scaled),
+                            name + "." + std::to_string(options.sizes[i]), num,
+                            encode_options);
+          }
+          name += "." + std::to_string(options.sizes[0]);
+        }
+        if (pipeline)
+        {
+          pipeline->Submit(std::move(bitmap), name, num, encode_options);
+          break;
+        }
         image_file_name =
-            WritePng(out_name.substr(0, extension_pos).c_str(), single_page ? -1 : page_index, buffer, stride, image_width, image_height);
+            WritePng(name.c_str(), num, buffer, stride, image_width, image_height,
+                     FPDFBitmap_GetFormat(bitmap.get()), encode_options);
         break;
       }
       default:
         break;
       }
+      document->bitmap_pool.Release(std::move(bitmap));
     }
-    else
+    else if (!render->reported)
     {
       fprintf(stderr, "Page was too large to be rendered.\n");
     }
 
+    render->failed = render->failed || !rendered;
+    if (render->variant + 1 < document->variants.size())
+    {
+      // The next variant starts over on the same page.
+      PageRender next;
+      next.page_index = page_index;
+      next.page = page;
+      next.text_page = std::move(render->text_page);
+      next.variant = render->variant + 1;
+      next.failed = render->failed;
+      next.deadline = PageDeadline(*document);
+      *render = std::move(next);
+      return StartVariant(document, render);
+    }
+
     FORM_DoPageAAction(page, form, FPDFPAGE_AACTION_CLOSE);
     idler();
 
     FORM_OnBeforeClosePage(page, form);
     idler();
 
-    return !!bitmap;
+    // Releasing the page may close it, so its text page has to go first.
+    render->text_page.reset();
+    document->page_cache->Release(page_index, /*form_closed=*/true);
+    return render->failed ? PageStatus::kBad : PageStatus::kProcessed;
   }
 
-  void ProcessPdf(const std::string &name,
-                  const std::string &out_name,
-                  const char *buf,
-                  size_t len,
-                  const Options &options,
-                  const std::function<void()> &idler)
+  PageStatus ProcessPage(Document *document, int page_index)
   {
-    TestLoader loader({buf, len});
+    PageRender render;
+    PageStatus status = StartPage(document, page_index, &render);
+    while (status == PageStatus::kRendering)
+    {
+      while (!ContinuePage(document, &render, Clock::now() + kRenderTimeSlice))
+      {
+      }
+      status = FinishPage(document, &render);
+    }
+    if (status != PageStatus::kAbort)
+      document->idler();
+    return status;
+  }
 
-    FPDF_FILEACCESS file_access = {};
-    file_access.m_FileLen = static_cast<unsigned long>(len);
-    file_access.m_GetBlock = TestLoader::GetBlock;
-    file_access.m_Param = &loader;
+#ifndef _WIN32
+  // Renders pages [first_page, last_page) in |jobs| forked children that all
+  // inherit the already parsed document; child k takes every |jobs|-th page
+  // starting at first_page + k. Children report one byte per finished page
+  // over a pipe, so the pages of a child that crashed are counted as bad.
+  void ProcessPagesForked(int first_page,
+                          int last_page,
+                          int jobs,
+                          const std::function<PageStatus(int)> &process_page,
+                          const std::function<void()> &finish_pages,
+                          ProcessResult *result)
+  {
+    jobs = std::min(jobs, last_page - first_page);
+    std::vector<pid_t> children;
+    std::vector<int> pipes;
+    fflush(stdout);
+    fflush(stderr);
+    for (int k = 0; k < jobs; ++k)
+    {
+      int fds[2];
+      pid_t pid = -1;
+      if (pipe(fds) == 0)
+      {
+        pid = fork();
+        if (pid < 0)
+        {
+          close(fds[0]);
+          close(fds[1]);
+        }
+      }
+      if (pid < 0)
+      {
+        // Render the shares of the children that could not be started here.
+        fprintf(stderr, "Failed to fork page job: %s\n", strerror(errno));
+        for (int i = first_page; i < last_page; ++i)
+        {
+          if ((i - first_page) % jobs < k)
+            continue;
+          PageStatus status = process_page(i);
+          if (status == PageStatus::kProcessed)
+            ++result->processed_pages;
+          else
+            ++result->bad_pages;
+          if (status == PageStatus::kAbort)
+            break;
+        }
+        finish_pages();
+        break;
+      }
+      if (pid == 0)
+      {
+        for (int fd : pipes)
+          close(fd);
+        close(fds[0]);
+        for (int i = first_page + k; i < last_page; i += jobs)
+        {
+          PageStatus status = process_page(i);
+          if (status == PageStatus::kAbort)
+            break;
+          char report = status == PageStatus::kProcessed ? 'p' : 's';
+          if (write(fds[1], &report, 1) != 1)
+            break;
+        }
+        finish_pages();
+        fflush(stdout);
+        _exit(0);
+      }
+      close(fds[1]);
+      children.push_back(pid);
+      pipes.push_back(fds[0]);
+    }
 
-    FX_FILEAVAIL file_avail = {};
-    file_avail.version = 1;
-    file_avail.IsDataAvail = Is_Data_Avail;
+    for (size_t k = 0; k < children.size(); ++k)
+    {
+      int expected =
+          (last_page - first_page - static_cast<int>(k) + jobs - 1) / jobs;
+      int reported = 0;
+      char reports[256];
+      ssize_t n;
+      while ((n = read(pipes[k], reports, sizeof(reports))) != 0)
+      {
+        if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+        for (ssize_t i = 0; i < n; ++i)
+        {
+          if (reports[i] == 'p')
+            ++result->processed_pages;
+          else
+            ++result->bad_pages;
+        }
+        reported += static_cast<int>(n);
+      }
+      close(pipes[k]);
 
-    FX_DOWNLOADHINTS hints = {};
-    hints.version = 1;
-    hints.AddSegment = Add_Segment;
+      int status = 0;
+      while (waitpid(children[k], &status, 0) < 0 && errno == EINTR)
+      {
+      }
+      if (WIFSIGNALED(status))
+        fprintf(stderr, "Page job %zu was terminated by signal %d.\n", k,
+                WTERMSIG(status));
+      result->bad_pages += expected - reported;
+    }
+  }
+#endif // _WIN32
 
-    // |pdf_avail| must outlive |doc|.
-    ScopedFPDFAvail pdf_avail(FPDFAvail_Create(&file_avail, &file_access));
+  // Loads the document and does what has to happen before its first page.
+  // Returns false if it could not be loaded.
+  bool OpenDocument(Document *document)
+  {
+    const Options &options = document->options;
+    const PdfInput &input = document->input;
+    ProcessResult &result = document->result;
+    if (options.doc_timeout > 0)
+    {
+      document->deadline =
+          Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                             std::chrono::duration<double>(options.doc_timeout));
+    }
 
-    // |doc| must outlive |form_callbacks.loaded_pages|.
-    ScopedFPDFDocument doc;
+    FPDF_FILEACCESS &memory_access = document->memory_access;
+    memory_access.m_FileLen = static_cast<unsigned long>(input.len);
+    memory_access.m_GetBlock = TestLoader::GetBlock;
+    memory_access.m_Param = &document->loader;
+
+    FX_FILEAVAIL &memory_avail = document->memory_avail;
+    memory_avail.version = 1;
+    memory_avail.IsDataAvail = Is_Data_Avail;
+
+    FX_DOWNLOADHINTS &memory_hints = document->memory_hints;
+    memory_hints.version = 1;
+    memory_hints.AddSegment = Add_Segment;
+
+    FPDF_FILEACCESS *file_access = &memory_access;
+    FX_FILEAVAIL *file_avail = &memory_avail;
+    FX_DOWNLOADHINTS *hints = &memory_hints;
+#ifndef _WIN32
+    if (input.reader)
+      file_access = input.reader->file_access();
+    if (input.stream)
+    {
+      file_access = input.stream->file_access();
+      file_avail = input.stream->file_avail();
+      hints = input.stream->hints();
+    }
+#endif
+    document->file_access = file_access;
+    document->file_avail = file_avail;
+    document->hints = hints;
+
+    document->pdf_avail.reset(FPDFAvail_Create(file_avail, file_access));
+    FPDF_AVAIL pdf_avail = document->pdf_avail.get();
+    ScopedFPDFDocument &doc = document->doc;
 
     const char *password =
         options.password.empty() ? nullptr : options.password.c_str();
-    bool is_linearized = false;
     if (options.use_load_mem_document)
     {
-      doc.reset(FPDF_LoadMemDocument(buf, len, password));
+      doc.reset(FPDF_LoadMemDocument(input.buf, input.len, password));
     }
     else
     {
-      if (FPDFAvail_IsLinearized(pdf_avail.get()) == PDF_LINEARIZED)
+      if (FPDFAvail_IsLinearized(pdf_avail) == PDF_LINEARIZED)
       {
         int avail_status = PDF_DATA_NOTAVAIL;
-        doc.reset(FPDFAvail_GetDocument(pdf_avail.get(), password));
+        doc.reset(FPDFAvail_GetDocument(pdf_avail, password));
         if (doc)
         {
-          while (avail_status == PDF_DATA_NOTAVAIL)
-            avail_status = FPDFAvail_IsDocAvail(pdf_avail.get(), &hints);
+          avail_status = FPDFAvail_IsDocAvail(pdf_avail, hints);
+          while (avail_status == PDF_DATA_NOTAVAIL && WaitForData(*document))
+            avail_status = FPDFAvail_IsDocAvail(pdf_avail, hints);
 
           if (avail_status == PDF_DATA_ERROR)
           {
             fprintf(stderr, "Unknown error in checking if doc was available.\n");
-            return;
+            return false;
           }
-          avail_status = FPDFAvail_IsFormAvail(pdf_avail.get(), &hints);
+          avail_status = FPDFAvail_IsFormAvail(pdf_avail, hints);
+          while (avail_status == PDF_FORM_NOTAVAIL && WaitForData(*document))
+            avail_status = FPDFAvail_IsFormAvail(pdf_avail, hints);
           if (avail_status == PDF_FORM_ERROR ||
               avail_status == PDF_FORM_NOTAVAIL)
           {
             fprintf(stderr,
                     "Error %d was returned in checking if form was available.\n",
                     avail_status);
-            return;
+            return false;
           }
-          is_linearized = true;
+          document->is_linearized = true;
         }
       }
       else
       {
-        doc.reset(FPDF_LoadCustomDocument(&file_access, password));
+        doc.reset(FPDF_LoadCustomDocument(file_access, password));
       }
     }
 
     if (!doc)
     {
       PrintLastError();
-      return;
+      return false;
     }
+    result.loaded = true;
 
     if (!FPDF_DocumentHasValidCrossReferenceTable(doc.get()))
       fprintf(stderr, "Document has invalid cross reference table\n");
 
     (void)FPDF_GetDocPermissions(doc.get());
 
-    FPDF_FORMFILLINFO_PDFiumTest form_callbacks = {};
+    document->page_cache = std::make_unique<PageCache>(
+        doc.get(), options.page_cache_size);
+
+    FPDF_FORMFILLINFO_PDFiumTest &form_callbacks = document->form_callbacks;
+    form_callbacks.page_cache = document->page_cache.get();
 #ifdef PDF_ENABLE_XFA
     form_callbacks.version = 2;
     form_callbacks.xfa_disabled =
@@ -784,9 +2383,10 @@ namespace
 #endif // PDF_ENABLE_XFA
     form_callbacks.FFI_GetPage = GetPageForIndex;
 
-    ScopedFPDFFormHandle form(
-        FPDFDOC_InitFormFillEnvironment(doc.get(), &form_callbacks));
+    ScopedFPDFFormHandle &form = document->form;
+    form.reset(FPDFDOC_InitFormFillEnvironment(doc.get(), &form_callbacks));
     form_callbacks.form_handle = form.get();
+    document->page_cache->set_form_handle(form.get());
 
 #ifdef PDF_ENABLE_XFA
     if (!options.disable_xfa && !options.disable_javascript)
@@ -815,44 +2415,506 @@ namespace
 #endif
 
     int page_count = FPDF_GetPageCount(doc.get());
-    int processed_pages = 0;
-    int bad_pages = 0;
-    int first_page = options.pages ? options.first_page : 0;
-    int last_page = options.pages ? options.last_page + 1 : page_count;
-    bool single_page = first_page == last_page - 1;
-    for (int i = first_page; i < last_page; ++i)
+    document->first_page = options.pages ? options.first_page : 0;
+    document->last_page = options.pages ? options.last_page + 1 : page_count;
+    document->single_page = document->first_page == document->last_page - 1;
+    return true;
+  }
+
+  // Does what has to happen after the last page and reports on the document.
+  void CloseDocument(Document *document)
+  {
+    if (document->pipeline)
+      document->pipeline->Finish();
+
+    FORM_DoDocumentAAction(document->form.get(), FPDFDOC_AACTION_WC);
+    document->idler();
+
+    const ProcessResult &result = document->result;
+    fprintf(stderr, "Processed %d pages.\n", result.processed_pages);
+    if (result.bad_pages)
+      fprintf(stderr, "Skipped %d bad pages.\n", result.bad_pages);
+    const PageCache::Stats &cache_stats = document->page_cache->stats();
+    if (cache_stats.hits || cache_stats.evictions)
+    {
+      fprintf(stderr, "Page cache: %d hits, %d misses, %d evictions.\n",
+              cache_stats.hits, cache_stats.misses, cache_stats.evictions);
+    }
+#ifndef _WIN32
+    const PdfInput &input = document->input;
+    if (input.reader)
+    {
+      fprintf(stderr, "Read %llu of %llu bytes.\n",
+              static_cast<unsigned long long>(input.reader->bytes_read()),
+              static_cast<unsigned long long>(input.reader->length()));
+    }
+#endif
+  }
+
+  // Loads the document of |input| as far as it is known and processes its
+  // pages.
+  ProcessResult ProcessDocument(const std::string &name,
+                                const std::string &out_name,
+                                const PdfInput &input,
+                                const Options &options,
+                                const std::function<void()> &idler)
+  {
+    Document document(name, out_name, input, options, idler);
+    ProcessResult &result = document.result;
+    if (!OpenDocument(&document))
+      return result;
+
+    auto finish_pages = [&document]()
+    {
+      if (document.pipeline)
+        document.pipeline->Finish();
+    };
+    auto process_page = [&document](int i)
     {
-      if (is_linearized)
+      return ProcessPage(&document, i);
+    };
+
+    int first_page = document.first_page;
+    int last_page = document.last_page;
+#ifndef _WIN32
+    // Forked page jobs would not inherit the thread reading the stream.
+    if (options.jobs > 1 && last_page - first_page > 1 && !input.stream)
+    {
+      ProcessPagesForked(first_page, last_page, options.jobs, process_page,
+                         finish_pages, &result);
+    }
+    else
+#endif // _WIN32
+    {
+      for (int i = first_page; i < last_page; ++i)
       {
-        int avail_status = PDF_DATA_NOTAVAIL;
-        while (avail_status == PDF_DATA_NOTAVAIL)
-          avail_status = FPDFAvail_IsPageAvail(pdf_avail.get(), i, &hints);
+        PageStatus status = process_page(i);
+        if (status == PageStatus::kProcessed)
+          ++result.processed_pages;
+        else
+          ++result.bad_pages;
+        // The page counts as bad, and the document is closed as usual.
+        if (status == PageStatus::kAbort)
+          break;
+      }
+    }
 
-        if (avail_status == PDF_DATA_ERROR)
+    CloseDocument(&document);
+    return result;
+  }
+
+  // Returns true if |input| is a stream that went on past the length the
+  // document was loaded with, which then has to be processed again.
+  bool InputGrewPastLength(const PdfInput &input)
+  {
+#ifndef _WIN32
+    if (input.stream && input.stream->ExtendToEnd())
+    {
+      fprintf(stderr, "Input continues past its linearized length, processing it again.\n");
+      return true;
+    }
+#endif
+    return false;
+  }
+
+  ProcessResult ProcessPdf(const std::string &name,
+                           const std::string &out_name,
+                           const PdfInput &input,
+                           const Options &options,
+                           const std::function<void()> &idler)
+  {
+    ProcessResult result =
+        ProcessDocument(name, out_name, input, options, idler);
+    // Pages rendered from the linearized part lack the incremental updates
+    // appended after it.
+    if (InputGrewPastLength(input))
+      result = ProcessDocument(name, out_name, input, options, idler);
+    return result;
+  }
+
+  // Splits one manifest line into arguments. Arguments are separated by
+  // whitespace; single or double quotes keep spaces inside an argument.
+  bool SplitManifestLine(const std::string &line,
+                         std::vector<std::string> *args)
+  {
+    std::string arg;
+    bool in_arg = false;
+    char quote = 0;
+    for (size_t i = 0; i < line.size(); ++i)
+    {
+      char c = line[i];
+      if (quote)
+      {
+        if (c == quote)
+          quote = 0;
+        else if (c == '\\' && quote == '"' && i + 1 < line.size())
+          arg.push_back(line[++i]);
+        else
+          arg.push_back(c);
+      }
+      else if (c == '"' || c == '\'')
+      {
+        quote = c;
+        in_arg = true;
+      }
+      else if (c == ' ' || c == '\t' || c == '\r')
+      {
+        if (in_arg)
+          args->push_back(arg);
+        arg.clear();
+        in_arg = false;
+      }
+      else
+      {
+        arg.push_back(c);
+        in_arg = true;
+      }
+    }
+    if (quote)
+      return false;
+    if (in_arg)
+      args->push_back(arg);
+    return true;
+  }
+
+  // Formats the tab separated report of a batch job: status, milliseconds
+  // since |start|, processed and skipped pages, input and output file.
+  std::string FormatJobReport(const char *status,
+                              std::chrono::steady_clock::time_point start,
+                              const ProcessResult &result,
+                              const std::vector<std::string> &files)
+  {
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    char report[64];
+    snprintf(report, sizeof(report), "%s\t%.3f\t%d\t%d", status,
+             elapsed.count(), result.processed_pages, result.bad_pages);
+    std::string out(report);
+    for (size_t i = 0; i < 2; ++i)
+    {
+      out.append("\t");
+      if (i < files.size())
+        out.append(files[i]);
+    }
+    return out;
+  }
+
+  // Parses one manifest line ("[OPTION]... <input> <output>"). Returns false
+  // if it is not a valid job.
+  bool ParseBatchJob(const std::string &line,
+                     Options *options,
+                     std::vector<std::string> *files)
+  {
+    std::vector<std::string> args(1, "pdf-renderer");
+    if (SplitManifestLine(line, &args) &&
+        ParseCommandLine(args, options, files) && files->size() == 2 &&
+        options->batch_manifest.empty())
+    {
+      return true;
+    }
+    fprintf(stderr, "Invalid batch job: %s\n", line.c_str());
+    return false;
+  }
+
+  // Runs one manifest line and returns its report.
+  std::string RunBatchJob(const std::string &line,
+                          const std::function<void()> &idler)
+  {
+    auto start = std::chrono::steady_clock::now();
+    Options options;
+    std::vector<std::string> files;
+    ProcessResult result;
+    const char *status = "invalid";
+    if (ParseBatchJob(line, &options, &files))
+    {
+      status = "error";
+      PdfInput input;
+      if (OpenPdfInput(files[0], options, &input))
+      {
+        fprintf(stderr, "Processing PDF file %s.\n", files[0].c_str());
+        result = ProcessPdf(files[0], files[1], input, options, idler);
+        idler();
+        if (result.loaded)
+          status = result.bad_pages ? "failed" : "ok";
+      }
+    }
+
+    return FormatJobReport(status, start, result, files);
+  }
+
+  // A batch job of RunInterleaved(), with the page it is rendering, if any.
+  // Members are destroyed in reverse order, so |document| goes before the
+  // input and options it refers to.
+  struct InterleavedJob
+  {
+    int id = 0;
+    Clock::time_point start;
+    Options options;
+    std::vector<std::string> files;
+    PdfInput input;
+    std::unique_ptr<Document> document;
+    int next_page = 0;
+    std::unique_ptr<PageRender> render;
+    bool done = false;
+  };
+
+  // Gives |job| one time slice: starts its next page, renders the current
+  // page further or finishes it. Sets |job->done| once the document is done.
+  void AdvanceJob(InterleavedJob *job)
+  {
+    Document *document = job->document.get();
+    ProcessResult &result = document->result;
+    PageStatus status;
+    if (!job->render)
+    {
+      if (job->next_page >= document->last_page)
+      {
+        CloseDocument(document);
+        if (InputGrewPastLength(job->input))
         {
-          fprintf(stderr, "Unknown error in checking if page %d is available.\n",
-                  i);
-          return;
+          job->document = std::make_unique<Document>(
+              job->files[0], job->files[1], job->input, job->options,
+              document->idler);
+          job->next_page = job->document->first_page;
+          if (OpenDocument(job->document.get()))
+            return;
         }
+        job->done = true;
+        return;
       }
-      if (ProcessPage(name, out_name, doc.get(), form.get(), &form_callbacks, i, options,
-                      idler, single_page))
+      job->render = std::make_unique<PageRender>();
+      status = StartPage(document, job->next_page++, job->render.get());
+      // Starting a render already took its first slice.
+      if (status == PageStatus::kRendering)
+        return;
+    }
+    else
+    {
+      if (!ContinuePage(document, job->render.get(),
+                        Clock::now() + kRenderTimeSlice))
+        return;
+      status = FinishPage(document, job->render.get());
+      // The page goes on with its next variant.
+      if (status == PageStatus::kRendering)
+        return;
+    }
+    job->render.reset();
+
+    if (status == PageStatus::kProcessed)
+      ++result.processed_pages;
+    else
+      ++result.bad_pages;
+    // The page counts as bad, and the next slice closes the document.
+    if (status == PageStatus::kAbort)
+    {
+      job->next_page = document->last_page;
+      return;
+    }
+    document->idler();
+  }
+
+  // Runs the batch jobs from |next_job| on this thread, with up to |max_jobs|
+  // documents open at a time. Their progressive renders advance in rounds,
+  // each job by as many time slices per round as its --weight, so that a
+  // small job is not stuck behind a large one that came first. Jobs are
+  // reported as they finish.
+  void RunInterleaved(const std::function<bool(std::string *)> &next_job,
+                      const std::function<void(int, const std::string &)> &report,
+                      int max_jobs,
+                      const std::function<void()> &idler)
+  {
+    std::vector<std::unique_ptr<InterleavedJob>> jobs;
+    int job_count = 0;
+    bool more_jobs = true;
+    std::string line;
+    while (true)
+    {
+      while (more_jobs && static_cast<int>(jobs.size()) < max_jobs)
       {
-        ++processed_pages;
+        if (!next_job(&line))
+        {
+          more_jobs = false;
+          break;
+        }
+        auto job = std::make_unique<InterleavedJob>();
+        job->id = job_count++;
+        job->start = Clock::now();
+        const char *status = nullptr;
+        if (!ParseBatchJob(line, &job->options, &job->files))
+        {
+          status = "invalid";
+        }
+        else if (!OpenPdfInput(job->files[0], job->options, &job->input))
+        {
+          status = "error";
+        }
+        else
+        {
+          fprintf(stderr, "Processing PDF file %s.\n", job->files[0].c_str());
+          job->document = std::make_unique<Document>(
+              job->files[0], job->files[1], job->input, job->options, idler);
+          if (!OpenDocument(job->document.get()))
+            status = "error";
+          job->next_page = job->document->first_page;
+        }
+        if (status)
+        {
+          report(job->id, FormatJobReport(
+                              status, job->start,
+                              job->document ? job->document->result
+                                            : ProcessResult(),
+                              job->files));
+          continue;
+        }
+        jobs.push_back(std::move(job));
       }
-      else
+      if (jobs.empty())
+        break;
+
+      for (auto &job : jobs)
       {
-        ++bad_pages;
+        for (int i = 0; i < job->options.weight && !job->done; ++i)
+          AdvanceJob(job.get());
+      }
+
+      for (auto it = jobs.begin(); it != jobs.end();)
+      {
+        InterleavedJob &job = **it;
+        if (!job.done)
+        {
+          ++it;
+          continue;
+        }
+        idler();
+        const ProcessResult &result = job.document->result;
+        const char *status =
+            !result.loaded ? "error" : result.bad_pages ? "failed" : "ok";
+        report(job.id, FormatJobReport(status, job.start, result, job.files));
+        it = jobs.erase(it);
       }
-      idler();
     }
+  }
 
-    FORM_DoDocumentAAction(form.get(), FPDFDOC_AACTION_WC);
-    idler();
+#ifndef _WIN32
+  // A document that maps a non-embedded font, so rendering it sets up the
+  // font mapper and the system font list.
+  constexpr char kWarmUpPdf[] =
+      "%PDF-1.4\n"
+      "1 0 obj <</Type /Catalog /Pages 2 0 R>> endobj\n"
+      "2 0 obj <</Type /Pages /Kids [3 0 R] /Count 1>> endobj\n"
+      "3 0 obj <</Type /Page /Parent 2 0 R /MediaBox [0 0 72 72]\n"
+      "/Resources <</Font <</F1 4 0 R>>>> /Contents 5 0 R>> endobj\n"
+      "4 0 obj <</Type /Font /Subtype /TrueType /BaseFont /Verdana>> endobj\n"
+      "5 0 obj <</Length 35>> stream\n"
+      "BT /F1 24 Tf 8 24 Td (Warm) Tj ET\n"
+      "endstream endobj\n"
+      "trailer <</Root 1 0 R>>\n"
+      "%%EOF\n";
+
+  // Does the one-time library work before the batch workers are forked, so
+  // that they all inherit it.
+  void WarmUpLibrary()
+  {
+    ScopedFPDFDocument doc(
+        FPDF_LoadMemDocument(kWarmUpPdf, sizeof(kWarmUpPdf) - 1, nullptr));
+    if (!doc)
+      return;
+    ScopedFPDFPage page(FPDF_LoadPage(doc.get(), 0));
+    ScopedFPDFBitmap bitmap(FPDFBitmap_Create(72, 72, 0));
+    if (page && bitmap)
+      FPDF_RenderPageBitmap(bitmap.get(), page.get(), 0, 0, 72, 72, 0, 0);
+  }
+#endif // _WIN32
+
+  // Returns false if the manifest could not be read or any job did not
+  // succeed.
+  bool RunBatch(const std::string &manifest,
+                const Options &options,
+                const std::function<void()> &idler)
+  {
+    std::ifstream manifest_file;
+    if (manifest != "-")
+    {
+      manifest_file.open(manifest);
+      if (!manifest_file)
+      {
+        fprintf(stderr, "Failed to open: %s\n", manifest.c_str());
+        return false;
+      }
+    }
+    std::istream &in = manifest == "-" ? std::cin : manifest_file;
+
+    // Yields the next job line, skipping blank lines and comments.
+    auto next_job = [&in](std::string *line)
+    {
+      while (std::getline(in, *line))
+      {
+        size_t first = line->find_first_not_of(" \t\r");
+        if (first != std::string::npos && (*line)[first] != '#')
+          return true;
+      }
+      return false;
+    };
 
-    fprintf(stderr, "Processed %d pages.\n", processed_pages);
-    if (bad_pages)
-      fprintf(stderr, "Skipped %d bad pages.\n", bad_pages);
+    bool success = true;
+    auto report = [&success](int job, const std::string &report)
+    {
+      success &= report.compare(0, 3, "ok\t") == 0;
+      printf("%d\t%s\n", job, report.c_str());
+      fflush(stdout);
+    };
+
+#ifndef _WIN32
+    if (options.workers > 0)
+    {
+      WarmUpLibrary();
+
+      std::map<int, std::chrono::steady_clock::time_point> started;
+      auto next_pool_job = [&next_job, &started](std::string *line)
+      {
+        if (!next_job(line))
+          return false;
+        started[static_cast<int>(started.size())] =
+            std::chrono::steady_clock::now();
+        return true;
+      };
+      auto on_result = [&report, &started](int id, const std::string &line,
+                                           bool crashed,
+                                           const std::string &reply)
+      {
+        if (!crashed)
+        {
+          report(id, reply);
+          return;
+        }
+        std::vector<std::string> args;
+        SplitManifestLine(line, &args);
+        std::vector<std::string> files;
+        if (args.size() >= 2)
+          files.assign(args.end() - 2, args.end());
+        report(id, FormatJobReport("crashed", started[id], ProcessResult(),
+                                   files));
+      };
+
+      WorkerPool pool(options.workers, options.worker_max_jobs,
+                      static_cast<size_t>(options.worker_max_rss_mb) << 20,
+                      [&idler](const std::string &line)
+                      { return RunBatchJob(line, idler); });
+      return pool.Run(next_pool_job, on_result) && success;
+    }
+#endif // _WIN32
+
+    if (options.interleave > 1)
+    {
+      RunInterleaved(next_job, report, options.interleave, idler);
+      return success;
+    }
+
+    int job = 0;
+    std::string line;
+    while (next_job(&line))
+      report(job++, RunBatchJob(line, idler));
+    return success;
   }
 
   void ShowConfig()
@@ -874,13 +2936,46 @@ namespace
     config.append("ASAN");
     maybe_comma = ",";
 #endif // PDF_ENABLE_ASAN
+    config.append(maybe_comma);
+    config.append("SIMD=");
+    config.append(pixel_convert::Implementation());
     printf("%s\n", config.c_str());
   }
 
   constexpr char kUsageString[] =
       "Usage: pdfium_test [OPTION] [INPUT FILE] [OUTPUT FILE]\n"
+      "  An INPUT FILE of - streams the document from stdin; pages of linearized\n"
+      "  documents are rendered as soon as their data has arrived\n"
       "  --show-config          - print build options and exit\n"
       "  --mem-document         - load document with FPDF_LoadMemDocument()\n"
+      "  --no-mmap              - read the input into memory instead of mapping it\n"
+      "  --pread                - read only the parts of the input that are needed\n"
+      "  --pread-cache=<MiB>    - size of the --pread block cache (default 16)\n"
+      "  --page-cache=<number>  - keep at most that many pages loaded, 0 for all (default 16)\n"
+      "  --page-timeout=<seconds> - stop rendering a page after that long\n"
+      "  --doc-timeout=<seconds> - skip the remaining pages of a document after that long\n"
+      "  --partial-output       - write pages that timed out as far as they were rendered\n"
+      "  --max-pixels=<number>  - render larger pages at the largest scale within that many pixels\n"
+      "  --max-memory=<MiB>     - render pages at the largest scale whose bitmaps fit, counting\n"
+      "                           every bitmap the --encode-threads may hold at once\n"
+      "  --crop=x,y,w,h[pt]     - only render and write that region of each page, in output\n"
+      "                           pixels, or with pt in points from the top left corner\n"
+      "  --sizes=<px>,<px>...   - write each PNG page once per size, fitting its longer edge to it,\n"
+      "                           as <out>.<px>.<page-number>.png; overrides --scale, --width and\n"
+      "                           --height. The page is rendered once, at the largest size\n"
+      "  --variant=<name>[:<options>] - write each page as <out>.<name>.<page-number>.png, rendered\n"
+      "                           with these options added, quoted like a --batch line. Given\n"
+      "                           more than once, each page is loaded once for all variants.\n"
+      "                           Variant options replace those given before, but a variant\n"
+      "                           cannot take --password, --pages, --time or --batch, and the\n"
+      "                           options that load documents, schedule work or save images\n"
+      "                           keep their command line values\n"
+      "  --no-forms             - do not draw interactive form fields\n"
+      "  --use-thumbs           - scale PNG pages down from their embedded thumbnail when it is\n"
+      "                           at least as large, rather than render them; render flags and\n"
+      "                           forms do not apply to those pages\n"
+      "  --band-height=<rows>   - render and write PNG pages in bands of that many rows, so that\n"
+      "                           only one band is in memory; implies --render-oneshot\n"
       "  --render-oneshot       - render image without using progressive "
       "renderer\n"
       "  --lcd-text             - render text optimized for LCD displays\n"
@@ -894,8 +2989,8 @@ namespace
       "  --no-smoothtext        - render disabling text anti-aliasing\n"
       "  --no-smoothimage       - render disabling image anti-alisasing\n"
       "  --no-smoothpath        - render disabling path anti-aliasing\n"
-      "  --reverse-byte-order   - render to BGRA, if supported by the output "
-      "format\n"
+      "  --reverse-byte-order   - render in RGBA byte order, which PNG output takes without\n"
+      "                           converting\n"
       "  --save-images          - write raw embedded images "
       "<pdf-name>.<page-number>.<object-number>.png\n"
       "  --save-rendered-images - write embedded images as rendered on the page "
@@ -917,12 +3012,40 @@ namespace
       "  --password=<secret>    - password to decrypt the PDF with\n"
       "  --pages=<number>(-<number>) - only render the given 0-based page(s)\n"
       "  --png   - write page images <pdf-name>.<page-number>.png\n"
+      "  --dzi   - write each page as a Deep Zoom tile pyramid, <out>.dzi and <out>_files/\n"
+      "  --tile-size=<px>         - edge length of --dzi tiles (default 256, must be even)\n"
       "  --time=<number> - Seconds since the epoch to set system time.\n"
       "  --width=<width>          - override page width in pixels\n"
       "  --height=<height>        - override page height in pixels\n"
       "  --maintain-aspect-ratio  - Maintain aspect ratio when resizing the page\n"
       "  --allow-enlargement      - When maintaining the aspect ratio, allow one parameter to exceed the given height/width\n"
       "  --page=<number>(-<number>)- 0-based page number to be converted (default 0, alias of --pages)\n"
+      "  --batch=<manifest>       - convert every job in the manifest (- for stdin) in one process.\n"
+      "                             Each line holds \"[OPTION]... <input> <output>\"; one report line\n"
+      "                             \"<job> <status> <ms> <processed> <skipped> <input> <output>\" per job is\n"
+      "                             written to stdout\n"
+      "  --encode-threads=<number> - encode and write PNGs on background threads while rendering\n"
+      "  --png-threads=<number>   - deflate each PNG in that many row bands in parallel\n"
+      "  --png-full-color         - write RGB(A) PNGs even for pages that fit a gray or indexed PNG\n"
+      "                             of fewer bits per pixel; pages written in bands always are\n"
+      "  --png-encoder=<name>     - PNG compressor: libpng (default), or fast, an in-tree one made\n"
+      "                             for rendered pages that is several times faster for somewhat\n"
+      "                             larger files and ignores --png-level and --png-strategy;\n"
+      "                             pages written in bands always use libpng\n"
+      "  --png-preset=<name>      - PNG compression settings: fast (level 1, no filter), balanced\n"
+      "                             (level 4, none/up filters) or small (level 9); later --png-*\n"
+      "                             options override them\n"
+      "  --png-level=<number>     - zlib compression level of PNGs, 0 to 9 (-1: zlib default)\n"
+      "  --png-strategy=<name>    - zlib strategy of PNGs: default, filtered, rle or huffman\n"
+      "  --png-filters=<list>     - PNG row filters to choose from per row: all, or a comma\n"
+      "                             separated list of none, sub, up, average and paeth\n"
+      "  --jobs=<number>          - render the pages of a document in that many forked processes\n"
+      "  --workers=<number>       - run batch jobs in that many pre-forked worker processes\n"
+      "  --worker-max-jobs=<number> - replace a worker after it ran that many jobs\n"
+      "  --worker-max-rss=<MiB>   - replace a worker once its resident memory exceeds the limit\n"
+      "  --interleave=<number>    - without workers, keep that many batch jobs open and render them\n"
+      "                             in turns of short time slices on one thread\n"
+      "  --weight=<number>        - in a batch job, the time slices it gets per turn when interleaved\n"
       "";
 
 } // namespace
@@ -944,9 +3067,11 @@ int main(int argc, const char *argv[])
     return 0;
   }
 
-  if (files.size() != 2)
+  bool batch = !options.batch_manifest.empty();
+  if (batch ? !files.empty() : files.size() != 2)
   {
-    fprintf(stderr, "Please specify one input file and one output file.\n");
+    fprintf(stderr, batch ? "--batch takes no input or output file.\n"
+                          : "Please specify one input file and one output file.\n");
     return 1;
   }
 
@@ -961,6 +3086,15 @@ int main(int argc, const char *argv[])
 
   const char *path_array[2] = {nullptr, nullptr};
 
+#ifdef __GLIBC__
+  // Page bitmaps come from a BitmapPool, so glibc no longer sees the large
+  // free() that used to raise its mmap and trim thresholds after the first
+  // page. Raise them up front, so that per-page temporaries are reused from
+  // the heap instead of being mapped and faulted in again for every page.
+  mallopt(M_MMAP_THRESHOLD, 32 << 20);
+  mallopt(M_TRIM_THRESHOLD, 64 << 20);
+#endif
+
   FPDF_InitLibraryWithConfig(&config);
 
   UNSUPPORT_INFO unsupported_info = {};
@@ -980,13 +3114,18 @@ int main(int argc, const char *argv[])
                               { return gmtime(tp); });
   }
 
+  if (batch)
+  {
+    bool success = RunBatch(options.batch_manifest, options, idler);
+    FPDF_DestroyLibrary();
+    return success ? 0 : 1;
+  }
+
   const std::string &filename = files[0];
   const std::string &out_filename = files[1];
 
-  size_t file_length = 0;
-  std::unique_ptr<char, pdfium::FreeDeleter> file_contents =
-      GetFileContents(filename.c_str(), &file_length);
-  if (!file_contents)
+  PdfInput input;
+  if (!OpenPdfInput(filename, options, &input))
     return -1;
   fprintf(stderr, "Processing PDF file %s.\n", filename.c_str());
 
@@ -995,8 +3134,7 @@ int main(int argc, const char *argv[])
     CALLGRIND_START_INSTRUMENTATION;
 #endif // ENABLE_CALLGRIND
 
-  ProcessPdf(filename, out_filename, file_contents.get(), file_length, options,
-             idler);
+  ProcessPdf(filename, out_filename, input, options, idler);
   idler();
 
 #ifdef ENABLE_CALLGRIND
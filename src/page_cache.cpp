@@ -0,0 +1,115 @@
+#include "src/page_cache.h"
+
+#include <utility>
+
+PageCache::PageCache(FPDF_DOCUMENT doc, size_t capacity)
+    : doc_(doc), capacity_(capacity) {}
+
+// The form fill environment is gone by now, and took the page views with it,
+// so the pages are simply closed.
+PageCache::~PageCache() = default;
+
+FPDF_PAGE PageCache::Acquire(int index) {
+  Entry* entry = Load(index);
+  if (!entry)
+    return nullptr;
+  ++entry->pins;
+  ++acquired_;
+  return entry->page.get();
+}
+
+void PageCache::Release(int index, bool form_closed) {
+  auto it = pages_.find(index);
+  if (it == pages_.end())
+    return;
+  if (form_closed)
+    it->second.form_attached = false;
+  Unpin(index);
+  if (--acquired_ == 0) {
+    std::vector<int> borrowed;
+    borrowed.swap(borrowed_);
+    for (int borrowed_index : borrowed)
+      Unpin(borrowed_index);
+  }
+  Evict();
+}
+
+FPDF_PAGE PageCache::Get(int index) {
+  Entry* entry = Load(index);
+  if (!entry)
+    return nullptr;
+  if (acquired_ > 0) {
+    ++entry->pins;
+    borrowed_.push_back(index);
+  }
+  return entry->page.get();
+}
+
+PageCache::Entry* PageCache::Load(int index) {
+  auto it = pages_.find(index);
+  if (it != pages_.end()) {
+    ++stats_.hits;
+    Entry& entry = it->second;
+    lru_.splice(lru_.begin(), lru_, entry.lru);
+    if (!entry.form_attached && form_) {
+      entry.form_attached = true;
+      FORM_OnAfterLoadPage(entry.page.get(), form_);
+    }
+    return &entry;
+  }
+
+  ScopedFPDFPage page(FPDF_LoadPage(doc_, index));
+  if (!page)
+    return nullptr;
+  ++stats_.misses;
+
+  // Add the page first, the form calls below may ask for it again.
+  Entry& entry = pages_[index];
+  entry.page = std::move(page);
+  entry.lru = lru_.insert(lru_.begin(), index);
+  if (form_) {
+    entry.form_attached = true;
+    FORM_OnAfterLoadPage(entry.page.get(), form_);
+    FORM_DoPageAAction(entry.page.get(), form_, FPDFPAGE_AACTION_OPEN);
+  }
+  return &entry;
+}
+
+void PageCache::Unpin(int index) {
+  auto it = pages_.find(index);
+  if (it != pages_.end() && it->second.pins > 0)
+    --it->second.pins;
+}
+
+void PageCache::Evict() {
+  if (!capacity_)
+    return;
+  while (pages_.size() > capacity_) {
+    int victim = -1;
+    for (auto it = lru_.rbegin(); it != lru_.rend(); ++it) {
+      if (!pages_[*it].pins) {
+        victim = *it;
+        break;
+      }
+    }
+    if (victim < 0)
+      return;
+
+    Entry* entry = &pages_[victim];
+    if (entry->form_attached && form_) {
+      // Form callbacks run from here may use the cache; pin the page so that
+      // it stays put until it is closed below.
+      entry->form_attached = false;
+      ++entry->pins;
+      FORM_OnBeforeClosePage(entry->page.get(), form_);
+      entry = &pages_[victim];
+      --entry->pins;
+      // Attached again while closing, keep it for now.
+      if (entry->form_attached)
+        return;
+    }
+    lru_.erase(entry->lru);
+    pages_.erase(victim);
+    ++stats_.evictions;
+  }
+}
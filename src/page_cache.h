@@ -0,0 +1,73 @@
+#ifndef SRC_PAGE_CACHE_H_
+#define SRC_PAGE_CACHE_H_
+
+#include <stddef.h>
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "pdfium/include/cpp/fpdf_scopers.h"
+#include "pdfium/include/fpdf_formfill.h"
+
+// Keeps the most recently used pages of a document loaded, so that pages the
+// form callbacks ask for again are not parsed twice, without holding on to
+// every page of a large document. Pages are evicted least recently used
+// first, and only at points where PDFium holds no reference to them:
+// FORM_OnBeforeClosePage() runs before FPDF_ClosePage(). The page being
+// processed is pinned from Acquire() to Release(), and so is every page the
+// form callbacks load or use in the meantime.
+class PageCache {
+ public:
+  struct Stats {
+    int hits = 0;
+    int misses = 0;
+    int evictions = 0;
+  };
+
+  // Keeps up to |capacity| unpinned pages loaded; 0 keeps all of them.
+  PageCache(FPDF_DOCUMENT doc, size_t capacity);
+  ~PageCache();
+
+  PageCache(const PageCache&) = delete;
+  PageCache& operator=(const PageCache&) = delete;
+
+  void set_form_handle(FPDF_FORMHANDLE form) { form_ = form; }
+  const Stats& stats() const { return stats_; }
+
+  // Returns page |index|, loading it if needed, and pins it until Release().
+  FPDF_PAGE Acquire(int index);
+
+  // Unpins a page from Acquire(). |form_closed| tells that the caller ran
+  // FORM_OnBeforeClosePage() on it already.
+  void Release(int index, bool form_closed);
+
+  // Returns page |index| for a form callback. It stays pinned as long as any
+  // page from Acquire() is.
+  FPDF_PAGE Get(int index);
+
+ private:
+  struct Entry {
+    ScopedFPDFPage page;
+    int pins = 0;
+    bool form_attached = false;
+    std::list<int>::iterator lru;
+  };
+
+  Entry* Load(int index);
+  void Unpin(int index);
+  void Evict();
+
+  const FPDF_DOCUMENT doc_;
+  const size_t capacity_;
+  FPDF_FORMHANDLE form_ = nullptr;
+  Stats stats_;
+
+  std::unordered_map<int, Entry> pages_;
+  // Most recently used first.
+  std::list<int> lru_;
+  int acquired_ = 0;
+  std::vector<int> borrowed_;
+};
+
+#endif  // SRC_PAGE_CACHE_H_
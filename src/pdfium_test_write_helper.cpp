@@ -38,7 +38,9 @@ std::vector<uint8_t> EncodePng(pdfium::span<const uint8_t> input,
                                int width,
                                int height,
                                int stride,
-                               int format) {
+                               int format,
+                               const image_diff_png::EncodeOptions& options =
+                                   image_diff_png::EncodeOptions()) {
   std::vector<uint8_t> png;
   switch (format) {
     case FPDFBitmap_Unknown:
@@ -47,15 +49,18 @@ std::vector<uint8_t> EncodePng(pdfium::span<const uint8_t> input,
       png = image_diff_png::EncodeGrayPNG(input, width, height, stride);
       break;
     case FPDFBitmap_BGR:
-      png = image_diff_png::EncodeBGRPNG(input, width, height, stride);
+      png = image_diff_png::EncodeBGRPNG(input, width, height, stride,
+                                         options);
       break;
     case FPDFBitmap_BGRx:
       png = image_diff_png::EncodeBGRAPNG(input, width, height, stride,
-                                          /*discard_transparency=*/true);
+                                          /*discard_transparency=*/true,
+                                          options);
       break;
     case FPDFBitmap_BGRA:
       png = image_diff_png::EncodeBGRAPNG(input, width, height, stride,
-                                          /*discard_transparency=*/false);
+                                          /*discard_transparency=*/false,
+                                          options);
       break;
     default:
       NOTREACHED();
@@ -110,24 +115,7 @@ std::vector<uint8_t> EncodePng(pdfium::span<const uint8_t> input,
 // }
 
 
-std::string WritePng(const char* out_name,
-                     int num,
-                     void* buffer,
-                     int stride,
-                     int width,
-                     int height) {
-  if (!CheckDimensions(stride, width, height))
-    return "";
-
-  auto input =
-      pdfium::make_span(static_cast<uint8_t*>(buffer), stride * height);
-  std::vector<uint8_t> png_encoding =
-      EncodePng(input, width, height, stride, FPDFBitmap_BGRA);
-  if (png_encoding.empty()) {
-    fprintf(stderr, "Failed to convert bitmap to PNG\n");
-    return "";
-  }
-
+std::string GetPngFileName(const char* out_name, int num) {
   char filename[256];
   int chars_formatted =
     num>0
@@ -138,20 +126,64 @@ std::string WritePng(const char* out_name,
     fprintf(stderr, "Filename %s is too long\n", filename);
     return "";
   }
+  return std::string(filename);
+}
 
-  FILE* fp = fopen(filename, "wb");
+std::vector<uint8_t> EncodePagePng(
+    const void* buffer,
+    int stride,
+    int width,
+    int height,
+    int format,
+    const image_diff_png::EncodeOptions& options) {
+  if (!CheckDimensions(stride, width, height))
+    return std::vector<uint8_t>();
+
+  auto input =
+      pdfium::make_span(static_cast<const uint8_t*>(buffer), stride * height);
+  std::vector<uint8_t> png_encoding =
+      EncodePng(input, width, height, stride, format, options);
+  if (png_encoding.empty())
+    fprintf(stderr, "Failed to convert bitmap to PNG\n");
+  return png_encoding;
+}
+
+bool WritePngFile(const std::string& filename,
+                  const std::vector<uint8_t>& png_encoding) {
+  FILE* fp = fopen(filename.c_str(), "wb");
   if (!fp) {
-    fprintf(stderr, "Failed to open %s for output\n", filename);
-    return "";
+    fprintf(stderr, "Failed to open %s for output\n", filename.c_str());
+    return false;
   }
 
   size_t bytes_written =
       fwrite(&png_encoding.front(), 1, png_encoding.size(), fp);
-  if (bytes_written != png_encoding.size())
-    fprintf(stderr, "Failed to write to %s\n", filename);
+  bool success = bytes_written == png_encoding.size();
+  if (!success)
+    fprintf(stderr, "Failed to write to %s\n", filename.c_str());
 
   (void)fclose(fp);
-  return std::string(filename);
+  return success;
+}
+
+std::string WritePng(const char* out_name,
+                     int num,
+                     void* buffer,
+                     int stride,
+                     int width,
+                     int height,
+                     int format,
+                     const image_diff_png::EncodeOptions& options) {
+  std::vector<uint8_t> png_encoding =
+      EncodePagePng(buffer, stride, width, height, format, options);
+  if (png_encoding.empty())
+    return "";
+
+  std::string filename = GetPngFileName(out_name, num);
+  if (filename.empty())
+    return "";
+
+  return WritePngFile(filename, png_encoding) ? filename : "";
 }
 
 
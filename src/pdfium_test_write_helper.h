@@ -5,8 +5,12 @@
 #ifndef SAMPLES_PDFIUM_TEST_WRITE_HELPER_H_
 #define SAMPLES_PDFIUM_TEST_WRITE_HELPER_H_
 
+#include <stdint.h>
+
 #include <string>
+#include <vector>
 
+#include "lib/image_diff_png.h"
 #include "pdfium/include/fpdfview.h"
 
 // std::string WritePng(const char* pdf_name,
@@ -20,7 +24,23 @@ std::string WritePng(const char* out_name,
                      void* buffer,
                      int stride,
                      int width,
-                     int height);
+                     int height,
+                     int format,
+                     const image_diff_png::EncodeOptions& options);
+
+// The steps of WritePng(), for callers that run them on other threads. None
+// of them calls into PDFium. |format| is that of the bitmap the pixels come
+// from: BGRA is written as RGBA, BGRx and BGR as RGB.
+std::string GetPngFileName(const char* out_name, int num);
+std::vector<uint8_t> EncodePagePng(
+    const void* buffer,
+    int stride,
+    int width,
+    int height,
+    int format,
+    const image_diff_png::EncodeOptions& options);
+bool WritePngFile(const std::string& filename,
+                  const std::vector<uint8_t>& png_encoding);
 
 
 void WriteImages(FPDF_PAGE page, const char* pdf_name, int page_num);
@@ -0,0 +1,115 @@
+#include "src/render_pipeline.h"
+
+#include <utility>
+
+#include "src/pdfium_test_write_helper.h"
+
+RenderPipeline::RenderPipeline(int encoder_threads,
+                               int max_pending,
+                               BitmapPool* bitmap_pool)
+    : max_pending_(max_pending > 0 ? max_pending : 1),
+      bitmap_pool_(bitmap_pool) {
+  for (int i = 0; i < encoder_threads || i == 0; ++i)
+    encoders_.emplace_back(&RenderPipeline::EncodeLoop, this);
+  writer_ = std::thread(&RenderPipeline::WriteLoop, this);
+}
+
+RenderPipeline::~RenderPipeline() {
+  Finish();
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    stopping_ = true;
+  }
+  encode_ready_.notify_all();
+  write_ready_.notify_all();
+  for (std::thread& encoder : encoders_)
+    encoder.join();
+  writer_.join();
+  for (ScopedFPDFBitmap& bitmap : free_bitmaps_)
+    bitmap_pool_->Release(std::move(bitmap));
+}
+
+ScopedFPDFBitmap RenderPipeline::AcquireBitmap(int width,
+                                               int height,
+                                               int format) {
+  std::vector<ScopedFPDFBitmap> finished;
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    finished.swap(free_bitmaps_);
+  }
+  // Bitmaps are only destroyed here, on the PDFium thread.
+  for (ScopedFPDFBitmap& bitmap : finished)
+    bitmap_pool_->Release(std::move(bitmap));
+  return bitmap_pool_->Acquire(width, height, format);
+}
+
+void RenderPipeline::Submit(
+    ScopedFPDFBitmap bitmap,
+    const std::string& out_name,
+    int num,
+    const image_diff_png::EncodeOptions& encode_options) {
+  Page page;
+  page.buffer = FPDFBitmap_GetBuffer(bitmap.get());
+  page.stride = FPDFBitmap_GetStride(bitmap.get());
+  page.width = FPDFBitmap_GetWidth(bitmap.get());
+  page.height = FPDFBitmap_GetHeight(bitmap.get());
+  page.format = FPDFBitmap_GetFormat(bitmap.get());
+  page.bitmap = std::move(bitmap);
+  page.filename = GetPngFileName(out_name.c_str(), num);
+  page.encode_options = encode_options;
+
+  std::unique_lock<std::mutex> guard(lock_);
+  page_done_.wait(guard, [this] { return pending_ < max_pending_; });
+  ++pending_;
+  encode_queue_.push_back(std::move(page));
+  encode_ready_.notify_one();
+}
+
+void RenderPipeline::Finish() {
+  std::unique_lock<std::mutex> guard(lock_);
+  page_done_.wait(guard, [this] { return pending_ == 0; });
+}
+
+void RenderPipeline::EncodeLoop() {
+  std::unique_lock<std::mutex> guard(lock_);
+  while (true) {
+    encode_ready_.wait(guard,
+                       [this] { return stopping_ || !encode_queue_.empty(); });
+    if (encode_queue_.empty())
+      return;
+
+    Page page = std::move(encode_queue_.front());
+    encode_queue_.pop_front();
+    guard.unlock();
+    if (!page.filename.empty()) {
+      page.png = EncodePagePng(page.buffer, page.stride, page.width,
+                               page.height, page.format, page.encode_options);
+    }
+    guard.lock();
+
+    // The pixels are encoded, so the renderer may reuse the bitmap already.
+    free_bitmaps_.push_back(std::move(page.bitmap));
+    write_queue_.push_back(std::move(page));
+    write_ready_.notify_one();
+  }
+}
+
+void RenderPipeline::WriteLoop() {
+  std::unique_lock<std::mutex> guard(lock_);
+  while (true) {
+    write_ready_.wait(guard,
+                      [this] { return stopping_ || !write_queue_.empty(); });
+    if (write_queue_.empty())
+      return;
+
+    Page page = std::move(write_queue_.front());
+    write_queue_.pop_front();
+    guard.unlock();
+    if (!page.png.empty())
+      WritePngFile(page.filename, page.png);
+    guard.lock();
+
+    --pending_;
+    page_done_.notify_all();
+  }
+}
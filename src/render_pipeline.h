@@ -0,0 +1,79 @@
+#ifndef SRC_RENDER_PIPELINE_H_
+#define SRC_RENDER_PIPELINE_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lib/image_diff_png.h"
+#include "pdfium/include/cpp/fpdf_scopers.h"
+#include "src/bitmap_pool.h"
+
+// Takes PNG encoding and file output off the rendering thread. The thread
+// that owns the document renders a page and hands the bitmap over with
+// Submit(); encoder threads turn it into a PNG and a writer thread stores the
+// file. Encoding never calls into PDFium, so only the submitting thread ever
+// does, including creating and destroying bitmaps: finished bitmaps go back
+// to |bitmap_pool| from AcquireBitmap() for the next page.
+class RenderPipeline {
+ public:
+  // At most |max_pending| bitmaps are in flight; Submit() blocks beyond that.
+  // |bitmap_pool| must outlive the pipeline.
+  RenderPipeline(int encoder_threads, int max_pending, BitmapPool* bitmap_pool);
+  ~RenderPipeline();
+
+  RenderPipeline(const RenderPipeline&) = delete;
+  RenderPipeline& operator=(const RenderPipeline&) = delete;
+
+  // Returns a bitmap from the pool, with undefined content.
+  ScopedFPDFBitmap AcquireBitmap(int width, int height, int format);
+
+  // Queues |bitmap| to be written as GetPngFileName(out_name, num), encoded
+  // with |encode_options|.
+  void Submit(ScopedFPDFBitmap bitmap,
+              const std::string& out_name,
+              int num,
+              const image_diff_png::EncodeOptions& encode_options);
+
+  // Waits until every submitted page has been written.
+  void Finish();
+
+ private:
+  struct Page {
+    ScopedFPDFBitmap bitmap;
+    const void* buffer = nullptr;
+    int stride = 0;
+    int width = 0;
+    int height = 0;
+    int format = FPDFBitmap_Unknown;
+    std::string filename;
+    image_diff_png::EncodeOptions encode_options;
+    std::vector<uint8_t> png;
+  };
+
+  void EncodeLoop();
+  void WriteLoop();
+
+  const size_t max_pending_;
+  BitmapPool* const bitmap_pool_;
+
+  std::mutex lock_;
+  std::condition_variable encode_ready_;
+  std::condition_variable write_ready_;
+  std::condition_variable page_done_;
+  std::deque<Page> encode_queue_;
+  std::deque<Page> write_queue_;
+  std::vector<ScopedFPDFBitmap> free_bitmaps_;
+  size_t pending_ = 0;
+  bool stopping_ = false;
+
+  std::vector<std::thread> encoders_;
+  std::thread writer_;
+};
+
+#endif  // SRC_RENDER_PIPELINE_H_
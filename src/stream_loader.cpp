@@ -0,0 +1,217 @@
+#include "src/stream_loader.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+namespace {
+
+constexpr size_t kChunkSize = 1 << 20;
+
+// PDFium looks for the linearization dictionary within the first 1024 bytes.
+constexpr size_t kLinearizedHeaderSize = 1024;
+
+// Returns the /L entry of the linearization dictionary in |head|, or 0 if
+// there is none.
+size_t GetLinearizedLength(const std::string& head) {
+  size_t dict = head.find("/Linearized");
+  if (dict == std::string::npos)
+    return 0;
+  size_t dict_end = head.find(">>", dict);
+  for (size_t pos = head.find("/L", dict + 1); pos < dict_end;
+       pos = head.find("/L", pos + 1)) {
+    const char* value = head.c_str() + pos + 2;
+    if (isalpha(static_cast<unsigned char>(*value)))
+      continue;
+    char* value_end;
+    unsigned long long length = strtoull(value, &value_end, 10);
+    return value_end != value ? static_cast<size_t>(length) : 0;
+  }
+  return 0;
+}
+
+}  // namespace
+
+StreamLoader::StreamLoader(int fd) : fd_(fd) {
+  file_access_.m_GetBlock = GetBlock;
+  file_access_.m_Param = this;
+
+  file_avail_.version = 1;
+  file_avail_.IsDataAvail = IsDataAvail;
+  file_avail_.loader = this;
+
+  hints_.version = 1;
+  hints_.AddSegment = AddSegment;
+  hints_.loader = this;
+
+  if (pipe(stop_pipe_) != 0) {
+    fprintf(stderr, "Failed to create pipe: %s\n", strerror(errno));
+    stop_pipe_[0] = stop_pipe_[1] = -1;
+  }
+  reader_ = std::thread(&StreamLoader::ReadLoop, this);
+}
+
+StreamLoader::~StreamLoader() {
+  // The writer may never close its end, so wake the reader up explicitly.
+  if (stop_pipe_[1] >= 0) {
+    char stop = 0;
+    (void)!write(stop_pipe_[1], &stop, 1);
+  }
+  reader_.join();
+  for (int fd : stop_pipe_) {
+    if (fd >= 0)
+      close(fd);
+  }
+  close(fd_);
+}
+
+bool StreamLoader::WaitForLength() {
+  std::string head;
+  {
+    std::unique_lock<std::mutex> guard(lock_);
+    data_arrived_.wait(guard, [this] {
+      return ended_ || received_ >= kLinearizedHeaderSize;
+    });
+    head.resize(std::min(received_, kLinearizedHeaderSize));
+    CopyOut(0, reinterpret_cast<unsigned char*>(&head[0]), head.size());
+  }
+
+  // /L is only a hint: incremental updates may follow the linearized file.
+  size_t length = GetLinearizedLength(head);
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (received_ > length)
+      length = 0;
+  }
+  if (!length) {
+    WaitForEnd();
+    std::lock_guard<std::mutex> guard(lock_);
+    length = received_;
+  }
+  if (!length || length > static_cast<unsigned long>(-1))
+    return false;
+  file_access_.m_FileLen = static_cast<unsigned long>(length);
+  return true;
+}
+
+bool StreamLoader::ExtendToEnd() {
+  WaitForEnd();
+  std::lock_guard<std::mutex> guard(lock_);
+  if (received_ <= file_access_.m_FileLen ||
+      received_ > static_cast<unsigned long>(-1)) {
+    return false;
+  }
+  file_access_.m_FileLen = static_cast<unsigned long>(received_);
+  return true;
+}
+
+void StreamLoader::WaitForData() {
+  std::unique_lock<std::mutex> guard(lock_);
+  size_t target = wanted_ ? wanted_ : received_ + 1;
+  data_arrived_.wait(guard, [this, target] { return HasData(target); });
+  wanted_ = 0;
+}
+
+void StreamLoader::WaitForEnd() {
+  std::unique_lock<std::mutex> guard(lock_);
+  data_arrived_.wait(guard, [this] { return ended_; });
+}
+
+// static
+int StreamLoader::GetBlock(void* param,
+                           unsigned long pos,
+                           unsigned char* buf,
+                           unsigned long size) {
+  StreamLoader* loader = static_cast<StreamLoader*>(param);
+  size_t end = static_cast<size_t>(pos) + size;
+  if (end < pos)
+    return 0;
+
+  // PDFium normally asks only for data it was told is available, but reads
+  // outside the FPDFAvail protocol simply wait for it.
+  std::unique_lock<std::mutex> guard(loader->lock_);
+  loader->data_arrived_.wait(guard,
+                             [loader, end] { return loader->HasData(end); });
+  if (end > loader->received_)
+    return 0;
+  loader->CopyOut(pos, buf, size);
+  return 1;
+}
+
+// static
+FPDF_BOOL StreamLoader::IsDataAvail(FX_FILEAVAIL* avail,
+                                    size_t offset,
+                                    size_t size) {
+  StreamLoader* loader = static_cast<FileAvail*>(avail)->loader;
+  std::lock_guard<std::mutex> guard(loader->lock_);
+  return loader->HasData(offset + size);
+}
+
+// static
+void StreamLoader::AddSegment(FX_DOWNLOADHINTS* hints,
+                              size_t offset,
+                              size_t size) {
+  StreamLoader* loader = static_cast<DownloadHints*>(hints)->loader;
+  std::lock_guard<std::mutex> guard(loader->lock_);
+  loader->wanted_ = std::max(loader->wanted_, offset + size);
+}
+
+void StreamLoader::ReadLoop() {
+  while (true) {
+    char* dest;
+    size_t room;
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      if (chunks_.size() * kChunkSize == received_)
+        chunks_.emplace_back(new char[kChunkSize]);
+      dest = chunks_.back().get() + received_ % kChunkSize;
+      room = kChunkSize - received_ % kChunkSize;
+    }
+
+    pollfd fds[] = {{fd_, POLLIN, 0}, {stop_pipe_[0], POLLIN, 0}};
+    if (poll(fds, stop_pipe_[0] >= 0 ? 2 : 1, -1) < 0 && errno != EINTR)
+      break;
+    if (fds[1].revents)
+      break;
+    if (!fds[0].revents)
+      continue;
+
+    ssize_t n = read(fd_, dest, room);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+      continue;
+    if (n < 0)
+      fprintf(stderr, "Failed to read input: %s\n", strerror(errno));
+    if (n <= 0)
+      break;
+
+    std::lock_guard<std::mutex> guard(lock_);
+    received_ += n;
+    data_arrived_.notify_all();
+  }
+
+  std::lock_guard<std::mutex> guard(lock_);
+  ended_ = true;
+  data_arrived_.notify_all();
+}
+
+bool StreamLoader::HasData(size_t end) const {
+  return ended_ || end <= received_;
+}
+
+void StreamLoader::CopyOut(size_t pos, unsigned char* buf, size_t size) const {
+  while (size) {
+    size_t offset = pos % kChunkSize;
+    size_t n = std::min(size, kChunkSize - offset);
+    memcpy(buf, chunks_[pos / kChunkSize].get() + offset, n);
+    buf += n;
+    pos += n;
+    size -= n;
+  }
+}
@@ -0,0 +1,87 @@
+#ifndef SRC_STREAM_LOADER_H_
+#define SRC_STREAM_LOADER_H_
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "pdfium/include/fpdf_dataavail.h"
+#include "pdfium/include/fpdfview.h"
+
+// Reads a PDF from a pipe while PDFium is already working on it. A reader
+// thread appends whatever arrives to a list of fixed size chunks, so bytes
+// never move once received. PDFium learns through the FPDFAvail callbacks
+// what has arrived; instead of polling FPDFAvail_Is*Avail() in a loop, the
+// caller blocks in WaitForData() until the segments PDFium asked for are in.
+class StreamLoader {
+ public:
+  // Takes ownership of |fd|.
+  explicit StreamLoader(int fd);
+  ~StreamLoader();
+
+  StreamLoader(const StreamLoader&) = delete;
+  StreamLoader& operator=(const StreamLoader&) = delete;
+
+  // Determines the file length PDFium is told about. Linearized files state
+  // it in their first bytes, unless more than that has already arrived;
+  // anything else has to be read to the end first. Returns false if the
+  // stream turned out to be empty.
+  bool WaitForLength();
+
+  // Blocks until the whole stream has been read. If it went on past the
+  // length PDFium was told about, as linearized files with incremental
+  // updates appended do, makes the whole stream the file and returns true;
+  // the document then has to be loaded again.
+  bool ExtendToEnd();
+
+  // Blocks until every segment hinted since the last call has arrived, or
+  // some more data did if there were no hints, or the stream ended.
+  void WaitForData();
+
+  // Blocks until the whole stream has been read.
+  void WaitForEnd();
+
+  FPDF_FILEACCESS* file_access() { return &file_access_; }
+  FX_FILEAVAIL* file_avail() { return &file_avail_; }
+  FX_DOWNLOADHINTS* hints() { return &hints_; }
+
+ private:
+  struct FileAvail : FX_FILEAVAIL {
+    StreamLoader* loader;
+  };
+  struct DownloadHints : FX_DOWNLOADHINTS {
+    StreamLoader* loader;
+  };
+
+  static int GetBlock(void* param,
+                      unsigned long pos,
+                      unsigned char* buf,
+                      unsigned long size);
+  static FPDF_BOOL IsDataAvail(FX_FILEAVAIL* avail, size_t offset, size_t size);
+  static void AddSegment(FX_DOWNLOADHINTS* hints, size_t offset, size_t size);
+
+  void ReadLoop();
+  bool HasData(size_t end) const;
+  void CopyOut(size_t pos, unsigned char* buf, size_t size) const;
+
+  const int fd_;
+  int stop_pipe_[2];
+  FPDF_FILEACCESS file_access_ = {};
+  FileAvail file_avail_;
+  DownloadHints hints_;
+
+  mutable std::mutex lock_;
+  std::condition_variable data_arrived_;
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  size_t received_ = 0;
+  size_t wanted_ = 0;
+  bool ended_ = false;
+
+  std::thread reader_;
+};
+
+#endif  // SRC_STREAM_LOADER_H_
@@ -0,0 +1,207 @@
+#include "src/tile_pyramid.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include "lib/image_resize.h"
+#include "pdfium/include/fpdfview.h"
+#include "src/pdfium_test_write_helper.h"
+
+namespace {
+
+bool MakeDirectory(const std::string& path) {
+#ifdef _WIN32
+  int result = _mkdir(path.c_str());
+#else
+  int result = mkdir(path.c_str(), 0777);
+#endif
+  if (result == 0 || errno == EEXIST)
+    return true;
+  fprintf(stderr, "Failed to create %s: %s\n", path.c_str(), strerror(errno));
+  return false;
+}
+
+}  // namespace
+
+TilePyramid::TilePyramid(const std::string& name,
+                         int width,
+                         int height,
+                         int format,
+                         int tile_size,
+                         int threads,
+                         const image_diff_png::EncodeOptions& encode_options)
+    : name_(name),
+      width_(width),
+      height_(height),
+      format_(format),
+      tile_size_(tile_size),
+      threads_(std::max(threads, 1)),
+      encode_options_(encode_options) {
+  // Halve the image until a single pixel is left.
+  std::vector<Level> levels;
+  int level_width = width;
+  int level_height = height;
+  while (true) {
+    Level level;
+    level.width = level_width;
+    level.height = level_height;
+    level.stride = level_width * 4;
+    levels.push_back(std::move(level));
+    if (level_width <= 1 && level_height <= 1)
+      break;
+    level_width = (level_width + 1) / 2;
+    level_height = (level_height + 1) / 2;
+  }
+  levels_.assign(std::make_move_iterator(levels.rbegin()),
+                 std::make_move_iterator(levels.rend()));
+}
+
+TilePyramid::~TilePyramid() = default;
+
+bool TilePyramid::Open() {
+  failed_ = true;
+  if (width_ <= 0 || height_ <= 0 || tile_size_ < 2 || tile_size_ % 2)
+    return false;
+  if (!MakeDirectory(name_ + "_files"))
+    return false;
+  for (size_t level = 0; level < levels_.size(); ++level) {
+    if (!MakeDirectory(LevelDirectory(level)))
+      return false;
+  }
+  failed_ = false;
+  return true;
+}
+
+bool TilePyramid::AddRows(const uint8_t* input, int rows, int stride) {
+  Level& top = levels_.back();
+  if (failed_ || rows < 0 || rows > top.height - top.rows_added ||
+      stride < top.stride) {
+    failed_ = true;
+    return false;
+  }
+  if (!AddLevelRows(levels_.size() - 1, input, rows, stride))
+    failed_ = true;
+  return !failed_;
+}
+
+bool TilePyramid::Finish() {
+  const Level& top = levels_.back();
+  if (failed_ || top.rows_added != top.height) {
+    fprintf(stderr, "Failed to write the tiles of %s\n", name_.c_str());
+    return false;
+  }
+
+  std::string filename = name_ + ".dzi";
+  FILE* fp = fopen(filename.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "Failed to open %s for output\n", filename.c_str());
+    return false;
+  }
+  int written = fprintf(
+      fp,
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"\n"
+      "  TileSize=\"%d\" Overlap=\"0\" Format=\"png\">\n"
+      "  <Size Width=\"%d\" Height=\"%d\"/>\n"
+      "</Image>\n",
+      tile_size_, width_, height_);
+  bool success = written > 0 && fclose(fp) == 0;
+  if (!success)
+    fprintf(stderr, "Failed to write to %s\n", filename.c_str());
+  return success;
+}
+
+bool TilePyramid::AddLevelRows(size_t level,
+                               const uint8_t* input,
+                               int rows,
+                               int stride) {
+  Level& current = levels_[level];
+  if (current.pending.empty())
+    current.pending.resize(static_cast<size_t>(current.stride) * tile_size_);
+  while (rows > 0) {
+    int count = std::min(rows, tile_size_ - current.pending_rows);
+    for (int y = 0; y < count; ++y) {
+      memcpy(&current.pending[static_cast<size_t>(current.pending_rows + y) *
+                              current.stride],
+             input + static_cast<size_t>(y) * stride, current.stride);
+    }
+    input += static_cast<size_t>(count) * stride;
+    rows -= count;
+    current.pending_rows += count;
+    current.rows_added += count;
+    if (current.pending_rows == tile_size_ ||
+        current.rows_added == current.height) {
+      if (!FlushLevel(level))
+        return false;
+    }
+  }
+  return true;
+}
+
+// Writes the pending row of tiles of |level| and hands it on, halved, to the
+// level below. Rows of tiles start at even rows, so no pair of rows is split.
+bool TilePyramid::FlushLevel(size_t level) {
+  Level& current = levels_[level];
+  if (!WriteTiles(level))
+    return false;
+  int rows = current.pending_rows;
+  current.pending_rows = 0;
+  ++current.tile_row;
+  if (level == 0)
+    return true;
+
+  Level& below = levels_[level - 1];
+  int halved_rows = (rows + 1) / 2;
+  current.halved.resize(static_cast<size_t>(below.stride) * halved_rows);
+  image_resize::DownsampleBGRA2x(
+      current.pending.data(), current.width, rows, current.stride,
+      /*has_alpha=*/format_ == FPDFBitmap_BGRA, current.halved.data(),
+      below.stride);
+  return AddLevelRows(level - 1, current.halved.data(), halved_rows,
+                      below.stride);
+}
+
+bool TilePyramid::WriteTiles(size_t level) {
+  const Level& current = levels_[level];
+  int columns = (current.width + tile_size_ - 1) / tile_size_;
+  std::string directory = LevelDirectory(level);
+  std::atomic<int> next_column(0);
+  std::atomic<bool> success(true);
+  auto write_tiles = [&]() {
+    int column;
+    while ((column = next_column++) < columns) {
+      int left = column * tile_size_;
+      int tile_width = std::min(tile_size_, current.width - left);
+      std::vector<uint8_t> png = EncodePagePng(
+          &current.pending[static_cast<size_t>(left) * 4], current.stride,
+          tile_width, current.pending_rows, format_, encode_options_);
+      std::string filename = directory + "/" + std::to_string(column) + "_" +
+                             std::to_string(current.tile_row) + ".png";
+      if (png.empty() || !WritePngFile(filename, png))
+        success = false;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 1; i < std::min(threads_, columns); ++i)
+    threads.emplace_back(write_tiles);
+  write_tiles();
+  for (std::thread& thread : threads)
+    thread.join();
+  return success;
+}
+
+std::string TilePyramid::LevelDirectory(size_t level) const {
+  return name_ + "_files/" + std::to_string(level);
+}
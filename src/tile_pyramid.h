@@ -0,0 +1,76 @@
+#ifndef SRC_TILE_PYRAMID_H_
+#define SRC_TILE_PYRAMID_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "lib/image_diff_png.h"
+
+// Writes a BGRA or BGRx image as a Deep Zoom tile pyramid: |name|.dzi
+// describes it and |name|_files/<level>/<column>_<row>.png hold the tiles,
+// level 0 being a single pixel. The image arrives top to bottom as rows of
+// the full resolution level. Every lower level is built by halving the rows
+// of the level above as they come in, so only about one row of tiles per
+// level is ever in memory. The tiles of a row are encoded on up to |threads|
+// threads.
+class TilePyramid {
+ public:
+  // |tile_size| must be even. |format| is FPDFBitmap_BGRA, or
+  // FPDFBitmap_BGRx for an opaque image, whose tiles are written as RGB.
+  TilePyramid(const std::string& name,
+              int width,
+              int height,
+              int format,
+              int tile_size,
+              int threads,
+              const image_diff_png::EncodeOptions& encode_options);
+  ~TilePyramid();
+
+  TilePyramid(const TilePyramid&) = delete;
+  TilePyramid& operator=(const TilePyramid&) = delete;
+
+  // Creates the tile directories. Returns false on failure.
+  bool Open();
+
+  // Appends |rows| rows from |input|, |stride| bytes apart. Returns false on
+  // failure, after which every other call fails too.
+  bool AddRows(const uint8_t* input, int rows, int stride);
+
+  // Writes the descriptor once all rows were added. Without it, viewers
+  // ignore the tiles. Returns false if anything failed.
+  bool Finish();
+
+ private:
+  struct Level {
+    int width = 0;
+    int height = 0;
+    int stride = 0;
+    int rows_added = 0;
+    int tile_row = 0;
+    // Rows of the current row of tiles.
+    std::vector<uint8_t> pending;
+    int pending_rows = 0;
+    // |pending| halved, on its way to the level below.
+    std::vector<uint8_t> halved;
+  };
+
+  bool AddLevelRows(size_t level, const uint8_t* input, int rows, int stride);
+  bool FlushLevel(size_t level);
+  bool WriteTiles(size_t level);
+  std::string LevelDirectory(size_t level) const;
+
+  const std::string name_;
+  const int width_;
+  const int height_;
+  const int format_;
+  const int tile_size_;
+  const int threads_;
+  const image_diff_png::EncodeOptions encode_options_;
+  // From level 0, 1x1, up to the full image.
+  std::vector<Level> levels_;
+  bool failed_ = false;
+};
+
+#endif  // SRC_TILE_PYRAMID_H_
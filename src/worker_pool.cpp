@@ -0,0 +1,264 @@
+#include "src/worker_pool.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <utility>
+
+namespace {
+
+bool WriteAll(int fd, const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool ReadAll(int fd, void* data, size_t size) {
+  char* p = static_cast<char*>(data);
+  while (size) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Messages are a 32-bit length, a flag byte and the payload.
+bool WriteMessage(int fd, const std::string& payload, uint8_t flag) {
+  std::string message(5, '\0');
+  uint32_t size = static_cast<uint32_t>(payload.size());
+  memcpy(&message[0], &size, sizeof(size));
+  message[4] = static_cast<char>(flag);
+  message.append(payload);
+  return WriteAll(fd, message.data(), message.size());
+}
+
+bool ReadMessage(int fd, std::string* payload, uint8_t* flag) {
+  char header[5];
+  if (!ReadAll(fd, header, sizeof(header)))
+    return false;
+  uint32_t size;
+  memcpy(&size, header, sizeof(size));
+  *flag = static_cast<uint8_t>(header[4]);
+  payload->resize(size);
+  return size == 0 || ReadAll(fd, &(*payload)[0], size);
+}
+
+size_t ResidentSetSize() {
+#ifdef __linux__
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (!statm)
+    return 0;
+  unsigned long total = 0;
+  unsigned long resident = 0;
+  int fields = fscanf(statm, "%lu %lu", &total, &resident);
+  fclose(statm);
+  if (fields != 2)
+    return 0;
+  return static_cast<size_t>(resident) * sysconf(_SC_PAGESIZE);
+#else
+  return 0;
+#endif
+}
+
+}  // namespace
+
+WorkerPool::WorkerPool(int workers,
+                       int max_jobs,
+                       size_t max_rss_bytes,
+                       Handler handler)
+    : max_jobs_(max_jobs),
+      max_rss_bytes_(max_rss_bytes),
+      handler_(std::move(handler)),
+      workers_(workers > 0 ? workers : 1) {}
+
+WorkerPool::~WorkerPool() {
+  for (Worker& worker : workers_)
+    Retire(&worker);
+}
+
+bool WorkerPool::Spawn(Worker* worker) {
+  int to_worker[2];
+  int from_worker[2];
+  if (pipe(to_worker) != 0)
+    return false;
+  if (pipe(from_worker) != 0) {
+    close(to_worker[0]);
+    close(to_worker[1]);
+    return false;
+  }
+
+  // Anything still buffered would otherwise be written twice.
+  fflush(stdout);
+  fflush(stderr);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Failed to start worker: %s\n", strerror(errno));
+    for (int fd : {to_worker[0], to_worker[1], from_worker[0], from_worker[1]})
+      close(fd);
+    return false;
+  }
+  if (pid == 0) {
+    // The other workers must only see EOF from the supervisor, so drop every
+    // pipe end this worker inherited.
+    for (Worker& other : workers_) {
+      if (other.to_worker >= 0)
+        close(other.to_worker);
+      if (other.from_worker >= 0)
+        close(other.from_worker);
+    }
+    close(to_worker[1]);
+    close(from_worker[0]);
+    WorkerMain(to_worker[0], from_worker[1]);
+  }
+
+  close(to_worker[0]);
+  close(from_worker[1]);
+  worker->pid = pid;
+  worker->to_worker = to_worker[1];
+  worker->from_worker = from_worker[0];
+  worker->job_id = -1;
+  worker->job.clear();
+  return true;
+}
+
+void WorkerPool::Retire(Worker* worker) {
+  if (worker->pid < 0)
+    return;
+
+  // Closing the job pipe makes an idle worker exit on its own.
+  close(worker->to_worker);
+  close(worker->from_worker);
+  int status = 0;
+  while (waitpid(worker->pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  if (WIFSIGNALED(status)) {
+    fprintf(stderr, "Worker %d was terminated by signal %d.\n", worker->pid,
+            WTERMSIG(status));
+  }
+  *worker = Worker();
+}
+
+void WorkerPool::WorkerMain(int from_supervisor, int to_supervisor) {
+  int jobs = 0;
+  std::string job;
+  uint8_t flag;
+  while (ReadMessage(from_supervisor, &job, &flag)) {
+    std::string reply = handler_(job);
+    fflush(stdout);
+
+    bool retiring = (max_jobs_ > 0 && ++jobs >= max_jobs_) ||
+                    (max_rss_bytes_ > 0 && ResidentSetSize() > max_rss_bytes_);
+    if (!WriteMessage(to_supervisor, reply, retiring) || retiring)
+      break;
+  }
+  fflush(stdout);
+  _exit(0);
+}
+
+bool WorkerPool::Run(const JobSource& next_job,
+                     const ResultCallback& on_result) {
+  // A worker dying between jobs must not kill the supervisor.
+  signal(SIGPIPE, SIG_IGN);
+
+  int next_id = 0;
+  int busy = 0;
+  bool exhausted = false;
+  std::vector<pollfd> fds;
+  std::vector<Worker*> polled;
+  while (true) {
+    for (Worker& worker : workers_) {
+      if (exhausted)
+        break;
+      if (worker.job_id >= 0)
+        continue;
+      if (worker.pid < 0 && !Spawn(&worker))
+        continue;
+
+      std::string job;
+      if (!next_job(&job)) {
+        exhausted = true;
+        break;
+      }
+
+      // A worker that died while idle only shows up here; give the job one
+      // more try on a fresh worker before giving up on it.
+      bool sent = WriteMessage(worker.to_worker, job, 0);
+      if (!sent) {
+        Retire(&worker);
+        sent = Spawn(&worker) && WriteMessage(worker.to_worker, job, 0);
+      }
+      int id = next_id++;
+      if (!sent) {
+        Retire(&worker);
+        on_result(id, job, /*crashed=*/true, std::string());
+        continue;
+      }
+      worker.job_id = id;
+      worker.job = std::move(job);
+      ++busy;
+    }
+
+    if (!busy) {
+      if (exhausted)
+        return true;
+      // Jobs are left, but no worker could be started.
+      bool any_alive = false;
+      for (Worker& worker : workers_)
+        any_alive |= worker.pid >= 0;
+      if (!any_alive)
+        return false;
+      continue;
+    }
+
+    fds.clear();
+    polled.clear();
+    for (Worker& worker : workers_) {
+      if (worker.job_id < 0)
+        continue;
+      fds.push_back({worker.from_worker, POLLIN, 0});
+      polled.push_back(&worker);
+    }
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+      return false;
+    }
+
+    for (size_t i = 0; i < fds.size(); ++i) {
+      if (!fds[i].revents)
+        continue;
+      Worker* worker = polled[i];
+      int id = worker->job_id;
+      std::string reply;
+      uint8_t retiring = 0;
+      bool crashed = !ReadMessage(worker->from_worker, &reply, &retiring);
+      std::string job = std::move(worker->job);
+      --busy;
+      worker->job_id = -1;
+      if (crashed || retiring)
+        Retire(worker);
+      on_result(id, job, crashed, reply);
+    }
+  }
+}
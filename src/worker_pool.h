@@ -0,0 +1,61 @@
+#ifndef SRC_WORKER_POOL_H_
+#define SRC_WORKER_POOL_H_
+
+#include <sys/types.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Pre-forked pool of worker processes. Everything the supervisor set up
+// before Run() (an initialized PDFium library, loaded fonts) is inherited
+// copy-on-write by every worker, so jobs never pay that startup cost again.
+// A worker that crashes is replaced and its job reported as crashed; workers
+// are also replaced after |max_jobs| jobs or once their resident set grows
+// beyond |max_rss_bytes|, so leaks cannot accumulate.
+class WorkerPool {
+ public:
+  // Runs one job inside a worker and returns its reply.
+  using Handler = std::function<std::string(const std::string& job)>;
+
+  // Fetches the next job, returns false when there are no more.
+  using JobSource = std::function<bool(std::string* job)>;
+
+  // Called in the supervisor once |job|, the |id|-th job, finished. |crashed|
+  // is set when the worker died before replying, |reply| is empty then.
+  using ResultCallback = std::function<void(int id,
+                                            const std::string& job,
+                                            bool crashed,
+                                            const std::string& reply)>;
+
+  WorkerPool(int workers, int max_jobs, size_t max_rss_bytes, Handler handler);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  // Hands every job from |next_job| to whichever worker is idle and returns
+  // once all of them have been answered. Returns false if no worker could be
+  // started.
+  bool Run(const JobSource& next_job, const ResultCallback& on_result);
+
+ private:
+  struct Worker {
+    pid_t pid = -1;
+    int to_worker = -1;
+    int from_worker = -1;
+    int job_id = -1;
+    std::string job;
+  };
+
+  bool Spawn(Worker* worker);
+  void Retire(Worker* worker);
+  [[noreturn]] void WorkerMain(int from_supervisor, int to_supervisor);
+
+  const int max_jobs_;
+  const size_t max_rss_bytes_;
+  const Handler handler_;
+  std::vector<Worker> workers_;
+};
+
+#endif  // SRC_WORKER_POOL_H_